@@ -0,0 +1 @@
+SELECT topn_add_agg(item) FROM bench_items;
@@ -0,0 +1 @@
+SELECT count(*) FROM topn((SELECT jsonb_summary FROM bench_decode), 10);
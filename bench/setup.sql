@@ -0,0 +1,67 @@
+--
+-- Tables and helper functions of the topn benchmarks
+--
+CREATE EXTENSION IF NOT EXISTS topn;
+
+DROP TABLE IF EXISTS bench_items;
+DROP TABLE IF EXISTS bench_rollups;
+DROP TABLE IF EXISTS bench_decode;
+
+CREATE TABLE bench_items (
+	bucket int,
+	item_id bigint,
+	item text
+);
+
+CREATE TABLE bench_rollups (
+	bucket int,
+	jsonb_summary jsonb,
+	sketch_summary topn
+);
+
+-- a single summary with 10000 counters, all of which are decoded by topn()
+CREATE TABLE bench_decode (
+	jsonb_summary jsonb
+);
+
+INSERT INTO bench_decode
+	SELECT jsonb_object_agg('item-' || item_id, item_id)
+	FROM generate_series(1, 10000) AS item_id;
+
+-- returns an item id in [0, cardinality) whose frequency follows a Zipf
+-- distribution with the given skew, or a uniform one if the skew is 0
+CREATE OR REPLACE FUNCTION bench_zipf_item(cardinality bigint, skew float8)
+	RETURNS bigint
+	AS $$
+	SELECT LEAST(cardinality - 1, CASE
+		WHEN skew = 0 THEN floor(random() * cardinality)
+		WHEN skew = 1 THEN floor(exp(random() * ln((cardinality + 1)::float8))) - 1
+		ELSE floor(((((cardinality + 1)::float8 ^ (1 - skew)) - 1) * random() + 1) ^
+				   (1 / (1 - skew))) - 1
+	END)::bigint
+	$$ LANGUAGE sql VOLATILE;
+
+-- refills bench_items with the given number of rows
+CREATE OR REPLACE FUNCTION bench_generate_items(row_count int, cardinality bigint,
+												skew float8, bucket_count int)
+	RETURNS void
+	AS $$
+	TRUNCATE bench_items;
+	INSERT INTO bench_items
+		SELECT row_number % bucket_count, item_id, 'item-' || item_id
+		FROM (SELECT row_number, bench_zipf_item(cardinality, skew) AS item_id
+			  FROM generate_series(1, row_count) AS row_number) items;
+	ANALYZE bench_items;
+	$$ LANGUAGE sql VOLATILE;
+
+-- refills bench_rollups with one summary per bucket of bench_items
+CREATE OR REPLACE FUNCTION bench_generate_rollups()
+	RETURNS void
+	AS $$
+	TRUNCATE bench_rollups;
+	INSERT INTO bench_rollups
+		SELECT bucket, topn_add_agg(item), topn_sketch_agg(item)
+		FROM bench_items
+		GROUP BY bucket;
+	ANALYZE bench_rollups;
+	$$ LANGUAGE sql VOLATILE;
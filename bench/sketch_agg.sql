@@ -0,0 +1 @@
+SELECT topn_sketch_agg(item) FROM bench_items;
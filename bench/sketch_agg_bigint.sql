@@ -0,0 +1 @@
+SELECT topn_sketch_agg(item_id) FROM bench_items;
@@ -0,0 +1,4 @@
+\set bucket random(1, :buckets - 1)
+SELECT left_rollup.sketch_summary + right_rollup.sketch_summary
+FROM bench_rollups left_rollup, bench_rollups right_rollup
+WHERE left_rollup.bucket = :bucket - 1 AND right_rollup.bucket = :bucket;
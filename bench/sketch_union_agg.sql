@@ -0,0 +1 @@
+SELECT topn_union_agg(sketch_summary) FROM bench_rollups;
@@ -0,0 +1,2 @@
+\set bucket random(0, :buckets - 1)
+SELECT * FROM topn((SELECT jsonb_summary FROM bench_rollups WHERE bucket = :bucket), 10);
@@ -0,0 +1 @@
+SELECT topn_union_agg(jsonb_summary) FROM bench_rollups;
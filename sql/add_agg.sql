@@ -1,3 +1,15 @@
+--check that an update keeps the views which use the aggregates
+CREATE EXTENSION topn VERSION '2.7.0';
+CREATE VIEW topn_view AS
+SELECT topn_add_agg(v), topn_union_agg(j)
+FROM (VALUES ('a', '{"c": 1}'::jsonb), ('b', '{"c": 2}'::jsonb), ('a', NULL)) AS t(v, j);
+ALTER EXTENSION topn UPDATE;
+SELECT * FROM topn_view;
+SELECT aggmtransfn, aggminvtransfn, aggmfinalfn, aggmtranstype::regtype
+FROM pg_aggregate WHERE aggfnoid = 'topn_add_agg(text)'::regprocedure;
+DROP VIEW topn_view;
+DROP EXTENSION topn;
+
 CREATE EXTENSION topn;
 
 --
@@ -84,3 +96,209 @@ SELECT topn(topn_add_agg(cidr_column::text), 4) FROM cidr_table;
 
 --check aggregates for inet type
 SELECT topn(topn_add_agg(inet_column::text), 4) FROM inet_table;
+
+--check weighted aggregates
+SELECT topn(topn_add_agg(int_column::text, int_column + 1), 4) FROM numbers;
+SELECT topn(topn_add_agg(text_column, 2), 4) FROM strings;
+SELECT topn_add_agg(int_column::text, -1) FROM numbers;
+
+--check moving aggregates in windows
+SELECT i, topn_add_agg(v) OVER (ORDER BY i ROWS BETWEEN 2 PRECEDING AND CURRENT ROW)
+FROM (VALUES (1, 'a'), (2, 'b'), (3, 'a'), (4, 'c'), (5, NULL), (6, 'c')) AS t(i, v);
+SELECT i, topn_sketch_agg(v, i) OVER (ORDER BY i ROWS BETWEEN 1 PRECEDING AND CURRENT ROW)
+FROM (VALUES (1, 'a'), (2, 'b'), (3, 'a'), (4, 'c'), (5, NULL), (6, 'c')) AS t(i, v);
+SELECT i, topn_sketch_agg(i % 2) OVER (ORDER BY i ROWS BETWEEN 2 PRECEDING AND CURRENT ROW)
+FROM generate_series(1, 6) AS i;
+
+--check that moving aggregates match the aggregates without a window once they prune
+SET topn.number_of_counters to 2;
+CREATE TABLE window_items AS
+SELECT i, CASE WHEN i % 5 = 0 THEN 'hot' WHEN i % 5 = 1 THEN 'warm' ELSE 'c' || i END AS v,
+	   (CASE WHEN i % 5 = 0 THEN 0 WHEN i % 5 = 1 THEN 1 ELSE i END)::bigint AS n
+FROM generate_series(1, 40) AS i;
+SELECT count(*), bool_and(moving = fresh) FROM (
+	SELECT topn_add_agg(v) OVER w AS moving,
+		   (SELECT topn_add_agg(f.v) FROM window_items f WHERE f.i BETWEEN t.i - 9 AND t.i) AS fresh
+	FROM window_items t WINDOW w AS (ORDER BY i ROWS BETWEEN 9 PRECEDING AND CURRENT ROW)) AS c;
+SELECT count(*), bool_and(moving = fresh) FROM (
+	SELECT topn_add_agg(v, i % 3 + 1) OVER w AS moving,
+		   (SELECT topn_add_agg(f.v, f.i % 3 + 1) FROM window_items f WHERE f.i BETWEEN t.i - 9 AND t.i) AS fresh
+	FROM window_items t WINDOW w AS (ORDER BY i ROWS BETWEEN 9 PRECEDING AND CURRENT ROW)) AS c;
+SELECT count(*), bool_and(moving::jsonb = fresh::jsonb) FROM (
+	SELECT topn_sketch_agg(v, 1, 2) OVER w AS moving,
+		   (SELECT topn_sketch_agg(f.v, 1, 2) FROM window_items f WHERE f.i BETWEEN t.i - 9 AND t.i) AS fresh
+	FROM window_items t WINDOW w AS (ORDER BY i ROWS BETWEEN 9 PRECEDING AND CURRENT ROW)) AS c;
+SELECT count(*), bool_and(moving::jsonb = fresh::jsonb) FROM (
+	SELECT topn_sketch_agg(n) OVER w AS moving,
+		   (SELECT topn_sketch_agg(f.n) FROM window_items f WHERE f.i BETWEEN t.i - 9 AND t.i) AS fresh
+	FROM window_items t WINDOW w AS (ORDER BY i ROWS BETWEEN 9 PRECEDING AND CURRENT ROW)) AS c;
+DROP TABLE window_items;
+SET topn.number_of_counters to 4;
+
+--check the counters of the backend
+SELECT topn_stats_reset();
+SELECT topn_add_agg(i::text, i) FROM generate_series(1, 13) AS i;
+SELECT prune_count, evicted_items, merged_items, jsonb_decodes, jsonb_encodes,
+	   jsonb_encoded_bytes > 0 AS encoded, peak_state_size > 0 AS measured
+FROM topn_stats();
+SELECT topn_union_agg(v) FROM (VALUES ('{"a": 1, "b": 2}'::jsonb), ('{"a": 3}'::jsonb)) AS t(v);
+SELECT prune_count, evicted_items, merged_items, jsonb_decodes, jsonb_encodes,
+	   jsonb_decoded_bytes > 0 AS decoded
+FROM topn_stats();
+
+--the ties are ordered by the key order of the jsonb
+SELECT * FROM topn('{"a": 2, "b": 1, "c": 2, "d": 1, "e": 2}'::jsonb, 2);
+SELECT * FROM topn('{"a": 2, "b": 1, "c": 2, "d": 1, "e": 2}'::jsonb, 4);
+SELECT * FROM topn('{"b": 1, "a": 1}'::jsonb, 4);
+
+--check that topn_union decodes an argument which does not change only once
+SELECT (topn(v, 2)).* FROM (VALUES ('{"a": 1, "b": 3, "c": 2}'::jsonb)) AS t(v);
+SELECT topn_stats_reset();
+SELECT topn_union(v, '{"a": 1}'::jsonb)
+FROM (VALUES ('{"a": 1, "b": 3}'::jsonb), ('{"c": 2}'::jsonb), ('{"a": 1, "b": 3}'::jsonb)) AS t(v);
+SELECT topn_union(v, v) FROM (VALUES ('{"a": 1, "b": 3}'::jsonb)) AS t(v);
+SELECT jsonb_decodes FROM topn_stats();
+
+--check that topn decodes a jsonb which does not change only once
+SELECT topn_stats_reset();
+SELECT (topn(v, 2)).item
+FROM (VALUES ('{"a": 1, "b": 3, "c": 2}'::jsonb), ('{"a": 1, "b": 3, "c": 2}'::jsonb),
+			 ('{"a": 1, "b": 3, "c": 2}'::jsonb), ('{"d": 1}'::jsonb)) AS t(v);
+SELECT jsonb_decodes FROM topn_stats();
+
+--check that the moving aggregates are not counted as merges
+SELECT topn_stats_reset();
+SELECT i, topn_add_agg(v) OVER (ORDER BY i ROWS BETWEEN 1 PRECEDING AND CURRENT ROW)
+FROM (VALUES (1, 'a'), (2, 'b'), (3, 'a')) AS t(i, v);
+SELECT prune_count, merged_items FROM topn_stats();
+
+--check the counter table against GROUP BY while it grows to 2000 counters, whose
+--7 bit hash tags in the control bytes collide
+SET topn.number_of_counters to 2000;
+CREATE TABLE counter_items AS
+SELECT i, CASE WHEN i % 2000 % 3 = 0 THEN 'a key longer than the inline part ' || i % 2000
+			   ELSE (i % 2000)::text END AS v,
+	   CASE WHEN i % 37 % 2 = 0 THEN 'a key longer than the inline part ' || i % 37
+			ELSE (i % 37)::text END AS w
+FROM generate_series(1, 5000) AS i;
+SELECT topn_add_agg(v) = (SELECT jsonb_object_agg(v, c)
+						   FROM (SELECT v, count(*) AS c FROM counter_items GROUP BY v) g) AS same,
+	   topn_sketch_agg(v)::jsonb = (SELECT jsonb_object_agg(v, c)
+									FROM (SELECT v, count(*) AS c FROM counter_items GROUP BY v) g) AS sketch_same
+FROM counter_items;
+--a moving window removes every counter and adds it again 37 rows later, so the
+--deleted slots are reused
+SELECT count(*), bool_and(moving = fresh) FROM (
+	SELECT topn_add_agg(w) OVER win AS moving,
+		   (SELECT jsonb_object_agg(w, c)
+			FROM (SELECT f.w, count(*) AS c FROM counter_items f
+				  WHERE f.i BETWEEN t.i - 19 AND t.i GROUP BY f.w) g) AS fresh
+	FROM counter_items t WHERE i <= 600
+	WINDOW win AS (ORDER BY i ROWS BETWEEN 19 PRECEDING AND CURRENT ROW)) AS c;
+DROP TABLE counter_items;
+SET topn.number_of_counters to 4;
+
+--check the front cache against GROUP BY with hot keys which only differ in the
+--middle, so that they share a front cache entry
+CREATE TABLE cache_items AS
+SELECT i, CASE WHEN i % 8 = 1 THEN 'prefix01Asuffix01'
+			   WHEN i % 8 IN (2, 3) THEN 'prefix01Bsuffix01'
+			   WHEN i % 8 IN (4, 5, 6) THEN 'prefix01Csuffix01'
+			   ELSE 'cold ' || i % 500 END AS v,
+	   i % 5 + 1 AS weight
+FROM generate_series(1, 8000) AS i;
+SET topn.number_of_counters to 1000;
+SELECT topn_add_agg(v) = (SELECT jsonb_object_agg(v, c)
+						   FROM (SELECT v, count(*) AS c FROM cache_items GROUP BY v) g) AS same,
+	   topn_add_agg(v, weight) = (SELECT jsonb_object_agg(v, c)
+								  FROM (SELECT v, sum(weight) AS c FROM cache_items GROUP BY v) g) AS weighted_same,
+	   topn_sketch_agg(v)::jsonb = (SELECT jsonb_object_agg(v, c)
+									FROM (SELECT v, count(*) AS c FROM cache_items GROUP BY v) g) AS sketch_same
+FROM cache_items;
+--a moving window takes the hot keys out of the counters which the cache points to
+SELECT count(*), bool_and(moving = fresh) FROM (
+	SELECT topn_add_agg(v) OVER win AS moving,
+		   (SELECT jsonb_object_agg(v, c)
+			FROM (SELECT f.v, count(*) AS c FROM cache_items f
+				  WHERE f.i BETWEEN t.i - 9 AND t.i GROUP BY f.v) g) AS fresh
+	FROM cache_items t WHERE i <= 400
+	WINDOW win AS (ORDER BY i ROWS BETWEEN 9 PRECEDING AND CURRENT ROW)) AS c;
+--the state is pruned between the repeats of the hot keys
+SET topn.number_of_counters to 4;
+SELECT (SELECT array_agg(item || ': ' || frequency ORDER BY frequency DESC)
+		FROM topn((SELECT topn_add_agg(v) FROM cache_items), 3)) =
+	   (SELECT array_agg(v || ': ' || c ORDER BY c DESC)
+		FROM (SELECT v, count(*) AS c FROM cache_items GROUP BY v ORDER BY count(*) DESC LIMIT 3) g) AS same,
+	   (SELECT array_agg(item || ': ' || frequency ORDER BY frequency DESC)
+		FROM topn((SELECT topn_add_agg(v, weight) FROM cache_items), 3)) =
+	   (SELECT array_agg(v || ': ' || c ORDER BY c DESC)
+		FROM (SELECT v, sum(weight) AS c FROM cache_items GROUP BY v ORDER BY sum(weight) DESC LIMIT 3) g) AS weighted_same;
+DROP TABLE cache_items;
+
+--check the keys which fit into a counter and the longer ones, which are kept in
+--the key arena and share their first bytes
+SET topn.number_of_counters to 10;
+CREATE TABLE key_items AS
+SELECT repeat('k', length) || suffix AS v
+FROM (VALUES (15, '', 1), (16, '', 2), (17, '', 3), (16, 'x', 4), (40, '', 5), (39, 'x', 6)) AS k(length, suffix, count),
+	 generate_series(1, count);
+SELECT topn_add_agg(v) FROM key_items;
+SELECT topn_sketch_agg(v) FROM key_items;
+SELECT topn_union_agg(counters) FROM (SELECT topn_add_agg(v) AS counters FROM key_items GROUP BY v) AS t;
+DROP TABLE key_items;
+--the keys are clipped to 255 bytes at a character boundary
+SELECT octet_length(key) AS key_bytes, value AS frequency FROM jsonb_each((SELECT topn_add_agg(v)
+									 FROM (VALUES (repeat('a', 300)), (repeat('a', 255) || 'b')) AS t(v)));
+SELECT octet_length(v) AS item_bytes, octet_length(key) BETWEEN 252 AND 255 AS clipped,
+	   left(v, length(key)) = key AS prefix, value AS frequency
+FROM (VALUES (repeat('é', 200)), ('a' || repeat('€', 100)), (repeat('a', 254) || 'é')) AS t(v),
+	 LATERAL jsonb_each((SELECT topn_add_agg(x) FROM (SELECT v) AS s(x))) AS e
+ORDER BY 1 DESC;
+SET topn.number_of_counters to 4;
+
+--check the ties at the prune boundary, where any of the tied items may be kept
+SET topn.number_of_counters to 2;
+CREATE TABLE tie_items AS
+SELECT i, CASE WHEN i <= 3 OR i = 12 THEN 'a' WHEN i <= 9 THEN chr(94 + i) ELSE 'h' END AS v
+FROM generate_series(1, 12) AS i;
+--the seventh counter prunes the state to a and two of the tied items
+SELECT topn_add_agg(v ORDER BY i) FROM tie_items;
+SELECT count(*), sum(value::text::int) AS total, bool_or(key = 'a' AND value = '3') AS a_kept
+FROM jsonb_each((SELECT topn_add_agg(v ORDER BY i) FROM tie_items WHERE i <= 9));
+SELECT * FROM topn((SELECT topn_add_agg(v ORDER BY i) FROM tie_items WHERE i <= 9), 1);
+SELECT count(*), sum(value::text::int) AS total, bool_or(key = 'a' AND value = '5') AS a_kept
+FROM jsonb_each((SELECT topn_union_agg(j) FROM (VALUES ('{"a": 5, "b": 1, "c": 1}'::jsonb), ('{"d": 1, "e": 1}')) AS t(j)));
+DROP TABLE tie_items;
+SET topn.number_of_counters to 4;
+
+--check the keys which are escaped in the jsonb and the large frequencies
+SET topn.number_of_counters to 10;
+SELECT topn_add_agg(v)
+FROM (VALUES ('', 1), (E'\x01', 2), (E'\t', 3), ('"', 4), (E'\\', 5)) AS t(v, count), generate_series(1, count);
+SELECT topn_union_agg(j) FROM (VALUES ('{"": 1, "\u0001": 2, "\t": 3, "\"": 4, "\\": 5}'::jsonb)) AS t(j);
+SELECT topn_union_agg(j)
+FROM (VALUES ('{"a": 3000000000, "b": 9000000000000000000}'::jsonb), ('{"a": 3000000000}')) AS t(j);
+SELECT topn_add_agg(v, 4000000000) FROM (VALUES ('a'), ('a')) AS t(v);
+--check the bounds of a union whose evicted totals add up to more than the
+--largest frequency
+SELECT * FROM topn_with_error((
+	SELECT topn_union_agg(sketch ORDER BY i)
+	FROM (SELECT 1 AS i, topn_sketch_agg(v, w, 2) AS sketch
+		  FROM (VALUES ('a', 6000000000000000000), ('b', 5900000000000000000), ('c', 5500000000000000000),
+					   ('d', 5000000000000000000), ('e', 5100000000000000000),
+					   ('f', 5200000000000000000), ('g', 5300000000000000000)) AS t(v, w)
+		  UNION ALL
+		  SELECT 2, topn_sketch_agg(v, w, 2)
+		  FROM (VALUES ('x', 5000000000000000000), ('a', 4600000000000000000), ('c', 4500000000000000000),
+					   ('d', 4000000000000000000), ('e', 4100000000000000000),
+					   ('f', 4200000000000000000), ('g', 4300000000000000000)) AS t(v, w)) AS sketches), 2);
+SET topn.number_of_counters to 4;
+
+--check the groups which only have null items, whose counter tables are never created
+SELECT g, topn_add_agg(v), topn_sketch_agg(v)
+FROM (VALUES (1, NULL::text), (1, NULL), (2, 'a'), (2, NULL), (3, NULL)) AS t(g, v)
+GROUP BY g ORDER BY g;
+SELECT count(*) AS groups, count(*) FILTER (WHERE counters = '{}') AS empty_groups,
+	   sum((SELECT sum(value::text::int) FROM jsonb_each(counters))) AS total
+FROM (SELECT i % 1000 AS g, topn_add_agg(CASE WHEN i % 1000 < 500 THEN (i % 3)::text END) AS counters
+	  FROM generate_series(1, 5000) AS i GROUP BY 1) AS t;
@@ -88,3 +88,12 @@ $$
 ;
 
 SELECT (topn(topn_union_agg(jsonb_column), 10)).* from jsonb_table;
+
+-- batch and weighted add
+SELECT topn_add('{"a": 1}', ARRAY['a', 'b', NULL, 'a']);
+SELECT topn_add(NULL, ARRAY['c']);
+SELECT topn_add('{"a": 1}', NULL::text[]);
+SELECT topn_add('{"a": 1}', 'b', 5);
+SELECT topn_add('{"a": 1}', 'a', 0);
+SELECT topn_add(NULL, 'a', NULL);
+SELECT topn_add('{"a": 1}', 'a', -1);
@@ -0,0 +1,85 @@
+--
+--Testing the aggregates with parallel plans, which serialize the states of the
+--workers and combine them
+--
+CREATE TABLE parallel_items AS
+SELECT i,
+	   CASE WHEN i % 2 = 0 THEN (i % 500)::text
+			ELSE 'a key longer than the inline part ' || (i % 500) END AS text_item,
+	   CASE WHEN i % 10 = 0 THEN 'hot1' WHEN i % 10 IN (1, 2) THEN 'hot2'
+			WHEN i % 10 IN (3, 4, 5) THEN 'hot3' ELSE 'cold' || i END AS hot_item,
+	   (i % 700)::bigint AS int_item,
+	   md5((i % 300)::text)::uuid AS uuid_item,
+	   i % 5 + 1 AS weight
+FROM generate_series(1, 20000) AS i;
+CREATE TABLE parallel_rollups AS
+SELECT i % 100 AS bucket, topn_add_agg(text_item) AS counters,
+	   topn_sketch_agg(int_item) AS sketch
+FROM parallel_items GROUP BY 1;
+
+--the results of a serial plan
+SET max_parallel_workers_per_gather TO 0;
+CREATE TABLE serial_results AS
+SELECT topn_add_agg(text_item) AS text_agg,
+	   topn_add_agg(text_item, weight) AS weighted_agg,
+	   topn_sketch_agg(int_item)::jsonb AS int_agg,
+	   topn_sketch_agg(uuid_item)::jsonb AS uuid_agg,
+	   topn_sketch_agg(text_item, weight)::jsonb AS weighted_sketch_agg
+FROM parallel_items;
+CREATE TABLE serial_union_results AS
+SELECT topn_union_agg(counters) AS counters_union,
+	   topn_union_agg(sketch)::jsonb AS sketch_union
+FROM parallel_rollups;
+
+--the same aggregates with a parallel plan
+SET parallel_setup_cost TO 0;
+SET parallel_tuple_cost TO 0;
+SET min_parallel_table_scan_size TO 0;
+SET max_parallel_workers_per_gather TO 2;
+EXPLAIN (COSTS OFF)
+SELECT topn_add_agg(text_item), topn_add_agg(text_item, weight), topn_sketch_agg(int_item),
+	   topn_sketch_agg(uuid_item), topn_sketch_agg(text_item, weight)
+FROM parallel_items;
+SELECT s.text_agg = p.text_agg AS text_agg,
+	   s.weighted_agg = p.weighted_agg AS weighted_agg,
+	   s.int_agg = p.int_agg AS int_agg,
+	   s.uuid_agg = p.uuid_agg AS uuid_agg,
+	   s.weighted_sketch_agg = p.weighted_sketch_agg AS weighted_sketch_agg
+FROM serial_results s,
+	 (SELECT topn_add_agg(text_item) AS text_agg,
+			 topn_add_agg(text_item, weight) AS weighted_agg,
+			 topn_sketch_agg(int_item)::jsonb AS int_agg,
+			 topn_sketch_agg(uuid_item)::jsonb AS uuid_agg,
+			 topn_sketch_agg(text_item, weight)::jsonb AS weighted_sketch_agg
+	  FROM parallel_items) p;
+SELECT s.counters_union = p.counters_union AS counters_union,
+	   s.sketch_union = p.sketch_union AS sketch_union
+FROM serial_union_results s,
+	 (SELECT topn_union_agg(counters) AS counters_union,
+			 topn_union_agg(sketch)::jsonb AS sketch_union
+	  FROM parallel_rollups) p;
+
+--the workers which read no rows pass NULL states to the combine function
+EXPLAIN (COSTS OFF)
+SELECT topn_add_agg(text_item), topn_sketch_agg(int_item) FROM parallel_items WHERE i <= 3;
+SELECT topn_add_agg(text_item), topn_sketch_agg(int_item) FROM parallel_items WHERE i <= 3;
+SELECT topn_add_agg(text_item), topn_sketch_agg(int_item) FROM parallel_items WHERE i < 0;
+--the workers which only read null items serialize states without counters
+SELECT topn_add_agg(NULLIF(text_item, text_item)), topn_sketch_agg(NULLIF(int_item, int_item))
+FROM parallel_items;
+
+--the workers prune their states, but the frequent items are kept
+SET topn.number_of_counters TO 20;
+SELECT (topn(topn_add_agg(hot_item), 3)).* FROM parallel_items;
+SELECT (topn(topn_add_agg(hot_item, weight), 3)).* FROM parallel_items;
+SELECT (topn(topn_sketch_agg(hot_item), 3)).* FROM parallel_items;
+SET max_parallel_workers_per_gather TO 0;
+SELECT (topn(topn_add_agg(hot_item), 3)).* FROM parallel_items;
+SELECT (topn(topn_add_agg(hot_item, weight), 3)).* FROM parallel_items;
+SELECT (topn(topn_sketch_agg(hot_item), 3)).* FROM parallel_items;
+RESET topn.number_of_counters;
+
+DROP TABLE serial_union_results;
+DROP TABLE serial_results;
+DROP TABLE parallel_rollups;
+DROP TABLE parallel_items;
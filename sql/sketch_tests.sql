@@ -0,0 +1,167 @@
+--
+-- Testing the binary topn type
+--
+SET topn.number_of_counters TO 4;
+
+-- input and output
+SELECT '{}'::topn;
+SELECT '{"b": 2, "a": 3, "c": 1}'::topn;
+SELECT '{"a": 1, "a": 2}'::topn;
+SELECT '[1, 2]'::topn;
+
+-- conversion from and to jsonb
+SELECT '{"b": 2, "a": 3}'::jsonb::topn;
+SELECT '{"b": 2, "a": 3}'::topn::jsonb;
+
+CREATE TABLE sketch_table (
+	sketch_column topn
+);
+INSERT INTO sketch_table VALUES ('{"SA": 1}'::jsonb);
+SELECT sketch_column FROM sketch_table;
+
+-- add and union
+SELECT topn_sketch_add(NULL, NULL);
+SELECT topn_sketch_add(NULL, 'SA');
+SELECT topn_sketch_add('{"SA": 1}', NULL);
+SELECT topn_sketch_add('{"SA": 1}', 'SA');
+SELECT topn_sketch_add('{"a": 5, "b": 4, "c": 3, "d": 2}', 'e');
+SELECT topn_sketch_add('{"a": 5, "b": 4, "c": 3}', 'bb');
+SELECT topn_sketch_add('{"a": 5, "b": 4, "c": 3, "d": 2}', 'c');
+SELECT topn_sketch_add('{"a": 1}', ARRAY['a', 'b', NULL, 'a']);
+SELECT topn_sketch_add('{"a": 5, "b": 4, "c": 3, "d": 2}', ARRAY['e', 'e', 'e', 'e', 'f']);
+SELECT topn_sketch_add('{"a": 5, "b": 4, "c": 3, "d": 2}', 'e', 3);
+SELECT topn_sketch_add('{"a": 1}', 'a', 4);
+SELECT topn_sketch_add(NULL, 'a', NULL);
+SELECT topn_sketch_union('{"a": 1, "b": 2}', '{"b": 3, "c": 1}');
+SELECT '{"a": 1, "b": 2}'::topn + '{"b": 3, "c": 1}'::topn;
+
+-- topn function
+SELECT * FROM topn('{"a": 3, "b": 5, "c": 1, "d": 3}'::topn, 3);
+SELECT * FROM topn('{}'::topn, 3);
+SELECT * FROM topn('{"a": 3}'::topn, 4);
+SELECT * FROM topn('{"a": 2, "b": 1, "c": 2, "d": 1, "e": 2}'::topn, 2);
+SELECT * FROM topn('{"a": 2, "b": 1, "c": 2, "d": 1, "e": 2}'::topn, 4);
+SELECT * FROM topn('{"b": 1, "a": 1}'::topn, 4);
+
+-- aggregates
+CREATE TABLE items (
+	item text
+);
+INSERT INTO items SELECT NULL FROM generate_series(1,5);
+INSERT INTO items SELECT 'a' FROM generate_series(1,7);
+INSERT INTO items SELECT 'b' FROM generate_series(1,3);
+INSERT INTO items SELECT 'c' FROM generate_series(1,5);
+
+SELECT topn_sketch_agg(item) FROM items;
+SELECT topn_sketch_agg(item) FROM items WHERE item IS NULL;
+SELECT (topn(topn_sketch_agg(item), 2)).* FROM items;
+SELECT topn_sketch_agg(item, 2) FROM items;
+
+INSERT INTO sketch_table SELECT topn_sketch_agg(item) FROM items;
+INSERT INTO sketch_table VALUES (NULL);
+SELECT topn_union_agg(sketch_column) FROM sketch_table;
+SELECT topn_union_agg(sketch_column) FROM sketch_table WHERE sketch_column IS NULL;
+
+-- capacity of the counters
+SELECT topn_sketch_agg(item, 1, 2) FROM items;
+SELECT topn_add_agg(item, 1, 2) FROM items;
+SELECT * FROM topn((SELECT topn_sketch_agg(item, 1, 2) FROM items), 3);
+SELECT topn_sketch_agg(v, 1, 6) FROM (VALUES ('a'), ('b'), ('c'), ('d'), ('e'), ('f')) AS t(v);
+SELECT topn_sketch_agg(v, 1, 6) + '{"a": 2}'::topn FROM (VALUES ('a'), ('b'), ('c'), ('d'), ('e'), ('f')) AS t(v);
+SELECT topn_sketch_add(topn_sketch_add(topn_sketch_add(topn_sketch_empty(2), 'a'), 'b'), 'c');
+SELECT topn_sketch_empty(0);
+
+-- error bounds of the counters
+SELECT * FROM topn_with_error(topn_sketch_add(topn_sketch_add(topn_sketch_add(topn_sketch_empty(2), 'a'), 'b'), 'c', 3), 2);
+SELECT * FROM topn_with_error(topn_sketch_add(topn_sketch_add(topn_sketch_add(topn_sketch_add(topn_sketch_empty(2), 'a'), 'b'), 'c', 3), 'a', 2), 2);
+SELECT * FROM topn_with_error((SELECT topn_sketch_agg(v, 1, 2) FROM (VALUES ('a'), ('a'), ('a'), ('b'), ('b'), ('c')) AS t(v)) +
+							  (SELECT topn_sketch_agg(v, 1, 2) FROM (VALUES ('c'), ('c'), ('c'), ('c'), ('d')) AS t(v)), 2);
+SELECT * FROM topn_with_error('{}'::topn, 2);
+SELECT * FROM topn_with_error(topn_sketch_add(topn_sketch_empty(2), 'a'), 3);
+
+-- compact encoding
+SELECT topn_compact('{"ab": 3, "abc": 5, "abd": 1, "b": 2}'::topn, 3);
+SELECT topn_compact('{"b": 2, "a": 3, "c": 1}'::jsonb, 2);
+SELECT topn_compact('{}'::topn, 2);
+SELECT topn_compact('{"a": 1}'::topn, 0);
+SELECT * FROM topn_with_error(topn_compact(topn_sketch_add(topn_sketch_add(topn_sketch_add(topn_sketch_add(topn_sketch_empty(2), 'a'), 'b'), 'c', 3), 'a', 2), 2), 2);
+SELECT topn_sketch_add(topn_compact('{"a": 5, "b": 4}'::topn, 2), 'a');
+SELECT topn_compact('{"a": 5, "b": 4}'::topn, 2) + '{"b": 1, "c": 1}'::topn;
+SELECT pg_column_size(compact_sketch) < pg_column_size(sketch) AS smaller,
+	   compact_sketch::jsonb = sketch::jsonb AS same
+FROM (SELECT sketch, topn_compact(sketch, 100) AS compact_sketch
+	  FROM (SELECT topn_sketch_agg('item' || (i % 50), 1, 100) AS sketch
+			FROM generate_series(1, 500) AS i) AS t) AS c;
+SET topn.compact_sketches TO on;
+SELECT topn_sketch_agg(item) FROM items;
+SELECT topn_union_agg(sketch) FROM (SELECT topn_sketch_agg(item) AS sketch FROM items
+									UNION ALL
+									SELECT topn_sketch_agg(item) FROM items) AS t;
+RESET topn.compact_sketches;
+
+-- expanded values in PL/pgSQL variables
+CREATE FUNCTION add_items_in_loop(items text[]) RETURNS topn AS $$
+DECLARE
+	sketch topn;
+	item text;
+BEGIN
+	FOREACH item IN ARRAY items LOOP
+		sketch := topn_sketch_add(sketch, item);
+	END LOOP;
+	RETURN sketch + sketch;
+END;
+$$ LANGUAGE plpgsql;
+SELECT add_items_in_loop(ARRAY['a', 'b', 'a', 'c', 'a', 'b', 'd', 'e', 'a']);
+SELECT * FROM topn_with_error(add_items_in_loop(ARRAY['a', 'b', 'a', 'c', 'a', 'b', 'd', 'e', 'a']), 4);
+DROP FUNCTION add_items_in_loop(text[]);
+
+-- point lookups
+SELECT topn_frequency('{"a": 3, "b": 1}'::topn, 'a') AS hit, topn_frequency('{"a": 3, "b": 1}'::topn, 'c') AS miss;
+SELECT topn_frequency('{"a": 3, "b": 1}'::jsonb, 'b') AS hit, topn_frequency('{"a": 3, "b": 1}'::jsonb, 'c') AS miss;
+SELECT topn_frequency(topn_compact('{"ab": 3, "abc": 5, "abd": 1, "b": 2}'::topn, 4), 'abd') AS hit,
+	   topn_frequency(topn_compact('{"ab": 3, "abc": 5, "abd": 1, "b": 2}'::topn, 4), 'abe') AS miss;
+SELECT item, (topn_frequency_with_error(sketch, item)).*
+FROM (SELECT topn_sketch_add(topn_sketch_add(topn_sketch_add(topn_sketch_add(topn_sketch_empty(2), 'a'), 'b'), 'c', 3), 'a', 2) AS sketch) AS s,
+	 (VALUES ('a'), ('b'), ('c')) AS t(item)
+ORDER BY item;
+SELECT topn_frequency('{"7": 2, "3": 1}'::topn, 7) AS hit, topn_frequency('{"7": 2, "3": 1}'::topn, 'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11'::uuid) AS miss;
+
+-- bigint and uuid items
+CREATE TABLE typed_items (
+	int_item bigint,
+	uuid_item uuid
+);
+INSERT INTO typed_items SELECT NULL, NULL FROM generate_series(1,2);
+INSERT INTO typed_items SELECT -5, 'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11' FROM generate_series(1,3);
+INSERT INTO typed_items SELECT 10, 'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a12' FROM generate_series(1,6);
+INSERT INTO typed_items SELECT 2, NULL FROM generate_series(1,4);
+
+SELECT topn_sketch_agg(int_item) FROM typed_items;
+SELECT topn_sketch_agg(int_item::int) FROM typed_items;
+SELECT topn_add_agg(int_item) FROM typed_items;
+SELECT * FROM topn((SELECT topn_sketch_agg(int_item) FROM typed_items), 2, NULL::bigint);
+SELECT topn_sketch_agg(uuid_item) FROM typed_items;
+SELECT * FROM topn((SELECT topn_sketch_agg(uuid_item) FROM typed_items), 1, NULL::uuid);
+SELECT * FROM topn('{"7": 2, "3": 1}'::topn, 2, NULL::bigint);
+SELECT topn_sketch_add(topn_sketch_agg(int_item), '2') FROM typed_items;
+SELECT topn_sketch_agg(int_item) + '{"2": 1, "x": 1}'::topn FROM typed_items;
+SELECT topn_compact(topn_sketch_agg(int_item), 2) FROM typed_items;
+SELECT topn_frequency(topn_sketch_agg(int_item), 10) AS bigint_item, topn_frequency(topn_sketch_agg(int_item), '-5') AS text_item,
+	   topn_frequency(topn_sketch_agg(int_item), '010') AS padded_item FROM typed_items;
+SELECT topn_frequency(topn_sketch_agg(uuid_item), 'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a12'::uuid) AS uuid_item,
+	   topn_frequency(topn_sketch_agg(uuid_item), 'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11') AS text_item,
+	   topn_frequency(topn_sketch_agg(uuid_item), 10) AS bigint_item FROM typed_items;
+SELECT * FROM topn_frequency_with_error((SELECT topn_sketch_agg(int_item) FROM typed_items), 2);
+
+-- compact values with keys of the wrong size are rejected
+CREATE FUNCTION bytea_to_topn(bytea, bytea) RETURNS topn
+	AS 'byteacat' LANGUAGE internal IMMUTABLE STRICT;
+SELECT bytea_to_topn('\x0105030000000000010000000000000000000000000880000000000000070500', '');
+SELECT bytea_to_topn('\x01050300000000000100000000000000000000000004800000070500', '');
+SELECT bytea_to_topn('\x01060300000000000100000000000000000000000008a0eebc999c0b4ef80500', '');
+SELECT topn_frequency(bytea_to_topn('\x01050300000000000100000000000000000000000004800000070500', ''), 7);
+DROP FUNCTION bytea_to_topn(bytea, bytea);
+
+DROP TABLE typed_items;
+DROP TABLE items;
+DROP TABLE sketch_table;
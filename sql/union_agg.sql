@@ -72,3 +72,9 @@ INSERT INTO temp_table(topn_column) SELECT topn_add_agg(inet_column::TEXT) FROM
 INSERT INTO temp_table(topn_column) SELECT topn_add_agg(inet_column::TEXT) FROM inet_table;
 SELECT topn(topn_union_agg(topn_column), 3) from temp_table;
 SELECT count(*) FROM (SELECT jsonb_each(topn_union_agg(topn_column)) FROM temp_table) a;
+
+--check the groups which only have null or empty counters
+SELECT g, topn_union_agg(j)
+FROM (VALUES (1, NULL::jsonb), (1, NULL), (2, '{}'), (2, '{}'), (3, NULL), (3, '{}'),
+			 (4, '{}'), (4, '{"a": 2}'), (4, NULL), (4, '{"a": 1, "b": 1}')) AS t(g, j)
+GROUP BY g ORDER BY g;
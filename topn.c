@@ -17,24 +17,22 @@
 #include "access/hash.h"
 #include "access/htup_details.h"
 #include "catalog/pg_type.h"
-#if PG_VERSION_NUM >= 130000
-#include "common/jsonapi.h"
-#endif
 #include "funcapi.h"
 #include "lib/stringinfo.h"
+#include "libpq/pqformat.h"
 #include "mb/pg_wchar.h"
 #include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/datum.h"
-#include "utils/hsearch.h"
+#include "utils/expandeddatum.h"
+#include "utils/lsyscache.h"
 #include "utils/palloc.h"
+#include "utils/uuid.h"
 
 #include "utils/json.h"
 #include "utils/jsonb.h"
-#if PG_VERSION_NUM < 130000
-#include "utils/jsonapi.h"
-#endif
 #include "utils/memutils.h"
+#include "utils/tuplestore.h"
 
 /* declarations for dynamic loading */
 PG_MODULE_MAGIC;
@@ -42,12 +40,13 @@ PG_MODULE_MAGIC;
 /*
  * If the frequency type is changed to allow higher number of frequencies
  * or decreased MAX_FREQUENCY should change accordingly.
- * Additionally, in the topnGetDatum function, the get function of
+ * Additionally, in the topnGetTuple function, the get function of
  * respective data type should replace Int64GetDatum.
  */
 typedef int64 Frequency;
 static int32 NumberOfCounters = 1000;
 static int32 UnionFactor = 3;
+static bool CompactSketches = false;
 #define MAX_KEYSIZE 256
 #define MAX_FREQUENCY INT64_MAX
 
@@ -56,15 +55,17 @@ static int32 UnionFactor = 3;
 #define PG_RETURN_JSONB(jsonb) PG_RETURN_JSONB_P(jsonb)
 #endif
 
-#if PG_VERSION_NUM >= 170000
-#define makeJsonLexContextCstringLenCompat(lex, json, len, encoding, need_escapes) \
-	makeJsonLexContextCstringLen(lex, json, len, encoding, need_escapes);
-#elif PG_VERSION_NUM >= 130000
-#define makeJsonLexContextCstringLenCompat(lex, json, len, encoding, need_escapes) \
-	makeJsonLexContextCstringLen(json, len, encoding, need_escapes);
-#else
-#define makeJsonLexContextCstringLenCompat(lex, json, len, encoding, need_escapes) \
-	makeJsonLexContextCstringLen(json, len, need_escapes);
+#if PG_VERSION_NUM < 110000
+#define pq_sendint16(buf, i) pq_sendint(buf, i, 2)
+#define pq_sendint32(buf, i) pq_sendint(buf, i, 4)
+#endif
+
+#if PG_VERSION_NUM >= 150000 && PG_VERSION_NUM < 160000
+#define InitMaterializedSRF(fcinfo, flags) SetSingleFuncCall(fcinfo, flags)
+#endif
+
+#if PG_VERSION_NUM >= 180000
+#include "nodes/supportnodes.h"
 #endif
 
 
@@ -77,79 +78,568 @@ static int32 UnionFactor = 3;
 /* Taken from jsonb.h for PG version less than 10 */
 #define JsonContainerSize(jc) ((jc)->header & JB_CMASK)
 
-#if PG_VERSION_NUM < 160000
-#define JsonParseErrorType_compat void
-#define JSON_SUCCESS_COMPAT
-#else
-#define JsonParseErrorType_compat JsonParseErrorType
-#define JSON_SUCCESS_COMPAT JSON_SUCCESS
-#endif
-
 /* SQL Function definitions */
 PG_FUNCTION_INFO_V1(topn);
 PG_FUNCTION_INFO_V1(topn_add);
+PG_FUNCTION_INFO_V1(topn_add_array);
+PG_FUNCTION_INFO_V1(topn_add_weighted);
 PG_FUNCTION_INFO_V1(topn_union);
 PG_FUNCTION_INFO_V1(topn_add_trans);
+PG_FUNCTION_INFO_V1(topn_add_weighted_trans);
+PG_FUNCTION_INFO_V1(topn_add_typed_trans);
+PG_FUNCTION_INFO_V1(topn_remove_trans);
+PG_FUNCTION_INFO_V1(topn_remove_weighted_trans);
+PG_FUNCTION_INFO_V1(topn_remove_typed_trans);
 PG_FUNCTION_INFO_V1(topn_union_trans);
 PG_FUNCTION_INFO_V1(topn_union_internal);
 PG_FUNCTION_INFO_V1(topn_serialize);
 PG_FUNCTION_INFO_V1(topn_deserialize);
 PG_FUNCTION_INFO_V1(topn_pack);
+PG_FUNCTION_INFO_V1(topn_moving_pack);
+PG_FUNCTION_INFO_V1(topn_in);
+PG_FUNCTION_INFO_V1(topn_out);
+PG_FUNCTION_INFO_V1(topn_recv);
+PG_FUNCTION_INFO_V1(topn_send);
+PG_FUNCTION_INFO_V1(topn_to_jsonb);
+PG_FUNCTION_INFO_V1(jsonb_to_topn);
+PG_FUNCTION_INFO_V1(topn_sketch_topn);
+PG_FUNCTION_INFO_V1(topn_with_error);
+PG_FUNCTION_INFO_V1(topn_sketch_add);
+PG_FUNCTION_INFO_V1(topn_sketch_add_array);
+PG_FUNCTION_INFO_V1(topn_sketch_add_weighted);
+PG_FUNCTION_INFO_V1(topn_sketch_union);
+PG_FUNCTION_INFO_V1(topn_sketch_union_trans);
+PG_FUNCTION_INFO_V1(topn_sketch_pack);
+PG_FUNCTION_INFO_V1(topn_sketch_moving_pack);
+PG_FUNCTION_INFO_V1(topn_sketch_empty);
+PG_FUNCTION_INFO_V1(topn_compact);
+PG_FUNCTION_INFO_V1(jsonb_topn_compact);
+PG_FUNCTION_INFO_V1(topn_frequency);
+PG_FUNCTION_INFO_V1(topn_sketch_frequency);
+PG_FUNCTION_INFO_V1(topn_frequency_with_error);
+PG_FUNCTION_INFO_V1(topn_stats);
+PG_FUNCTION_INFO_V1(topn_stats_reset);
+#if PG_VERSION_NUM >= 180000
+PG_FUNCTION_INFO_V1(topn_sketch_support);
+#endif
 
 
 /*
- * TopnAggState is the main struct to handle aggregate functions.
- * It is used as an internal type and it is actually a lone HTAB.
- * The data is being aggregated in HTAB since theoretically its enter/delete
- * operations are in constant time and it has a dynamic size.
+ * TopnItemKey is the key of a counter. Keys which fit into the inline
+ * area are kept there completely. For longer keys, the inline area keeps the
+ * first bytes of the key and a pointer to the whole key, which is stored in the
+ * key arena of the TopnAggState. The hash of the key is computed once and kept
+ * together with the key, so the counter table never looks at the key bytes to
+ * hash them.
+ */
+#define TOPN_INLINE_KEY_SIZE 16
+#define TOPN_KEY_PREFIX_SIZE (TOPN_INLINE_KEY_SIZE - sizeof(const char *))
+
+typedef struct TopnItemKey
+{
+	uint32 hash;
+	uint32 length;
+	union
+	{
+		char inlineData[TOPN_INLINE_KEY_SIZE];
+		struct
+		{
+			char prefix[TOPN_KEY_PREFIX_SIZE];
+			const char *data;
+		} external;
+	} value;
+} TopnItemKey;
+
+#define TopnItemKeyIsInline(itemKey) ((itemKey)->length <= TOPN_INLINE_KEY_SIZE)
+#define TopnItemKeyData(itemKey) \
+	(TopnItemKeyIsInline(itemKey) ? (itemKey)->value.inlineData : \
+	 (itemKey)->value.external.data)
+
+/*
+ * The keys are the bytes of a text by default. The typed aggregates keep the
+ * bigint and uuid keys in a fixed size binary form instead, so the items do not
+ * need to be converted into text. The bigint keys are stored in big endian with
+ * a flipped sign bit, so that their bytewise order is their numeric order.
  */
-typedef struct TopnAggState TopnAggState;
+#define TOPN_KEY_TEXT 0
+#define TOPN_KEY_INT8 1
+#define TOPN_KEY_UUID 2
+#define TOPN_INT8_KEY_SIZE 8
+
+/* the longest text forms of the bigint and uuid keys */
+#define TOPN_INT8_TEXT_SIZE 20
+#define TOPN_UUID_TEXT_SIZE 36
 
 /*
  * FrequentTopnItem is the struct to keep frequent items and their frequencies
  * together. It is useful to sort the top-n items before returning in topn() function
- * and in the prune stage.
+ * and in the prune stage. The frequency only counts the occurrences since the
+ * counter was created, and the error bounds the occurrences it may have missed
+ * before. The error is relative to the errorBase of the TopnAggState.
  */
 typedef struct FrequentTopnItem
 {
-	char key[MAX_KEYSIZE];
+	TopnItemKey key;
 	Frequency frequency;
+	Frequency error;
 } FrequentTopnItem;
 
 /*
- * This struct is used by internal Postgres function which are directly
- * COPY/PASTEd from the source code.
+ * TopnItemCandidate points to a counter while the most frequent counters are
+ * selected. The order of the candidates is used to break the ties between equal
+ * frequencies.
+ */
+typedef struct TopnItemCandidate
+{
+	FrequentTopnItem *item;
+	int32 order;
+} TopnItemCandidate;
+
+/*
+ * TopnKeyBlock is a block of the key arena of a TopnAggState. The keys which do
+ * not fit into a TopnItemKey are copied one after another into these blocks,
+ * without any per key allocation overhead.
+ */
+typedef struct TopnKeyBlock
+{
+	struct TopnKeyBlock *next;
+	Size size;
+	Size usedSize;
+	char data[FLEXIBLE_ARRAY_MEMBER];
+} TopnKeyBlock;
+
+#define TOPN_KEY_BLOCK_MIN_SIZE 1024
+#define TOPN_KEY_BLOCK_MAX_SIZE (64 * 1024)
+
+/*
+ * TopnCounterTable is the hash table which keeps the counters of a
+ * TopnAggState. It uses open addressing: the counters are stored in a single
+ * array of slots, and each slot has a control byte which tells whether it is
+ * empty, deleted or full. A full slot keeps the lowest 7 bits of the hash of
+ * its key in the control byte. The slots are probed in groups of 8, and the
+ * control bytes of a group are compared with the hash bits at once as a 64 bit
+ * word, so the slots which cannot match are skipped without reading their
+ * counters. A lookup ends at the first group which has an empty slot.
+ *
+ * The generation is incremented whenever a counter is removed or the counters
+ * are moved, so that the pointers to the counters which are kept outside the
+ * table can be checked before they are used.
+ */
+typedef struct TopnCounterTable
+{
+	FrequentTopnItem *items;
+	uint8 *controlBytes;
+	uint32 slotCount;
+	uint32 itemCount;
+	uint32 deletedCount;
+	uint32 generation;
+	MemoryContext context;
+} TopnCounterTable;
+
+/* TopnCounterTableIterator keeps the position of a scan over the counters */
+typedef struct TopnCounterTableIterator
+{
+	TopnCounterTable *table;
+	uint32 slotIndex;
+} TopnCounterTableIterator;
+
+#define TOPN_TABLE_GROUP_SIZE 8
+#define TOPN_CONTROL_EMPTY 0x80
+#define TOPN_CONTROL_DELETED 0xFE
+#define TOPN_GROUP_LOW_BITS UINT64CONST(0x0101010101010101)
+#define TOPN_GROUP_HIGH_BITS UINT64CONST(0x8080808080808080)
+#define TopnControlIsFull(control) (((control) & 0x80) == 0)
+#define TopnHashControl(hash) ((uint8) ((hash) & 0x7F))
+#define TopnHashGroup(hash) ((hash) >> 7)
+
+/* the counter table of a TopnAggState starts with room for this many counters */
+#define TOPN_HASH_TABLE_INITIAL_SIZE 16
+
+/*
+ * TopnFrontCacheEntry points to the counter of a recently added key. The front
+ * cache of a TopnAggState is a direct mapped array of these entries, which is
+ * indexed by a cheap hash of the first and the last bytes of the key. When the
+ * key of the counter is the added key, the frequency is increased in place and
+ * the key is neither hashed nor looked up in the counter table. An entry is
+ * only valid as long as the generation of the counter table has not changed.
+ */
+typedef struct TopnFrontCacheEntry
+{
+	FrequentTopnItem *item;
+	uint32 generation;
+} TopnFrontCacheEntry;
+
+#define TOPN_FRONT_CACHE_BITS 5
+#define TOPN_FRONT_CACHE_SIZE (1 << TOPN_FRONT_CACHE_BITS)
+
+/*
+ * TopnAggState is the main struct to handle aggregate functions.
+ * It is used as an internal type and it keeps the counters in a counter table,
+ * whose enter/delete operations are in constant time and which has a dynamic
+ * size. The counters only keep a short part of the keys, and the rest of the
+ * keys is stored in the key arena, so the memory usage follows the real length
+ * of the keys. The capacity is the number of counters the state is pruned to,
+ * and 0 means that it follows the topn.number_of_counters setting.
+ *
+ * The evicted total bounds the frequency of any item which has no counter, so
+ * it grows whenever counters are pruned. A merge adds the evicted total of the
+ * other side to the error of every counter, which is done lazily by adding it
+ * to the error base instead of visiting all counters.
+ *
+ * The aggregates which add one item per row also keep a front cache of the
+ * counters of the recently added keys, which is allocated on the first row.
+ */
+typedef struct TopnAggState
+{
+	TopnCounterTable *hashTable;
+	TopnFrontCacheEntry *frontCache;
+	MemoryContext context;
+	uint8 keyType;
+	int32 capacity;
+	int32 unionFactor;
+	Frequency evictedTotal;
+	Frequency errorBase;
+	TopnKeyBlock *keyBlocks;
+	Size allocatedKeySize;
+	Size liveKeySize;
+} TopnAggState;
+
+/*
+ * TopnSketchItem keeps the frequency and the error of a single counter of a
+ * TopnSketch and the position of its key in the key area which follows the
+ * item array.
+ */
+typedef struct TopnSketchItem
+{
+	Frequency frequency;
+	Frequency error;
+	uint32 keyOffset;
+	uint32 keyLength;
+} TopnSketchItem;
+
+/*
+ * TopnSketch is the on-disk representation of the topn type. The items are
+ * kept sorted by their keys and the key bytes are packed, without terminating
+ * NULs, right after the item array. Since the counts are stored as integers,
+ * the sketch can be merged into a TopnAggState without going through jsonb.
+ * The lowest bits of the flags keep the type of the keys. The capacity and the
+ * union factor the sketch was built with are kept with it, so that merging it
+ * in another session does not cut it down to that session's setting. The
+ * evicted total is the upper bound of the frequency of the items which are not
+ * in the sketch.
+ *
+ * A sketch can also be stored in the compact encoding, which is marked with a
+ * flag. Then the header is followed by a stream of varints instead of the item
+ * array: the keys are written with prefix compression and the counts take as
+ * few bytes as their values need. Compact sketches are expanded into the layout
+ * above when they are read, so the functions only deal with that layout.
+ */
+typedef struct TopnSketch
+{
+	int32 vl_len_;          /* varlena header (do not touch directly!) */
+	uint8 version;
+	uint8 flags;
+	uint16 unionFactor;
+	int32 capacity;         /* 0 if topn.number_of_counters is used */
+	int32 itemCount;
+	Frequency evictedTotal;
+	TopnSketchItem items[FLEXIBLE_ARRAY_MEMBER];
+} TopnSketch;
+
+/*
+ * TopnSketchCallContext is used by the topn() function of the topn type to keep
+ * the sketch and its items sorted by frequency between the calls, together with
+ * the type the items are returned as.
+ */
+typedef struct TopnSketchCallContext
+{
+	TopnSketch *sketch;
+	TopnSketchItem **sortedItemArray;
+	Oid itemType;
+	Oid itemInputFunction;
+	Oid itemInputParam;
+} TopnSketchCallContext;
+
+#define TOPN_SKETCH_VERSION 1
+#define TOPN_SKETCH_KEY_TYPE_MASK 0x03
+#define TOPN_SKETCH_COMPACT 0x04
+#define TopnSketchKeyType(sketch) ((sketch)->flags & TOPN_SKETCH_KEY_TYPE_MASK)
+#define TopnSketchIsCompact(sketch) (((sketch)->flags & TOPN_SKETCH_COMPACT) != 0)
+#define TopnSketchCompactData(sketch) ((char *) (sketch)->items)
+#define TopnSketchHeaderSize (offsetof(TopnSketch, items))
+#define TopnSketchKeyData(sketch) ((char *) &((sketch)->items[(sketch)->itemCount]))
+#define PG_GETARG_TOPN_SKETCH(n) DatumGetTopnSketch(PG_GETARG_DATUM(n))
+#define PG_RETURN_TOPN_SKETCH(sketch) PG_RETURN_POINTER(sketch)
+
+/*
+ * ExpandedTopnSketch is the expanded object representation of the topn type.
+ * It keeps the sketch in its own memory context, so that the functions which
+ * get it as a read-write argument can change the counters in place and return
+ * it again, instead of copying the whole sketch for every item. PL/pgSQL keeps
+ * such values in its variables, and the sketch is only flattened, which is a
+ * copy of the same layout, when the value is stored or read by other functions.
  */
-typedef struct JsonbInState
+typedef struct ExpandedTopnSketch
 {
-	JsonbParseState *parseState;
-	JsonbValue *res;
-} JsonbInState;
+	ExpandedObjectHeader header;
+	TopnSketch *sketch;
+} ExpandedTopnSketch;
+
+#define PG_RETURN_EXPANDED_TOPN_SKETCH(expandedSketch) \
+	PG_RETURN_DATUM(EOHPGetRWDatum(&(expandedSketch)->header))
+
+/* a varint of a 64 bit value takes at most this many bytes */
+#define TOPN_VARINT_MAX_SIZE 10
+
+/*
+ * The version of the format topn_serialize writes. A serialized state has the
+ * version, the key type, the capacity, the union factor, the number of counters
+ * and the evicted total as its header, and each counter is at least the two
+ * varints of its counts and its hash.
+ */
+#define TOPN_SERIALIZED_VERSION 1
+#define TOPN_SERIALIZED_HEADER_MAX_SIZE (2 * sizeof(uint8) + 4 * TOPN_VARINT_MAX_SIZE)
+#define TOPN_SERIALIZED_ITEM_MIN_SIZE (2 + sizeof(uint32))
+
+/*
+ * TopnStatistics keeps the counters of the current backend which topn_stats()
+ * returns. The peak state size is the estimated memory of the largest
+ * TopnAggState seen when it was pruned, packed or serialized.
+ */
+typedef struct TopnStatistics
+{
+	int64 pruneCount;
+	int64 evictedItemCount;
+	int64 mergedItemCount;
+	int64 jsonbDecodeCount;
+	int64 jsonbDecodedBytes;
+	int64 jsonbEncodeCount;
+	int64 jsonbEncodedBytes;
+	Size peakStateSize;
+} TopnStatistics;
+
+#define TOPN_STATISTICS_COUNT 8
+
+static TopnStatistics TopnStats;
+
+/*
+ * TopnDecodedJsonb keeps the counters of a decoded jsonb sketch and the jsonb,
+ * which the long keys of the counters point into. The items are in the order of
+ * the jsonb, and the valid ones are at the start of the array.
+ */
+typedef struct TopnDecodedJsonb
+{
+	Jsonb *jsonb;
+	int elementCount;
+	int itemCount;
+	FrequentTopnItem *itemArray;
+} TopnDecodedJsonb;
+
+/* topn() and topn_union() keep one decoded sketch for each of their arguments */
+#define TOPN_JSONB_CACHE_SIZE 2
+
+/*
+ * TopnJsonbCache keeps the sketches which were last decoded by a topn() or
+ * topn_union() call site in its fn_extra, so that an argument which does not
+ * change between rows, or which is passed as both arguments of topn_union(), is
+ * only decoded once. The cache lives in the fn_mcxt of the call site. An
+ * argument is compared to an entry by its size first and by its content only
+ * if the sizes are equal. The pointer of the argument is not used, since the
+ * copy of a row may be put at the address of the copy of the previous row.
+ */
+typedef struct TopnJsonbCache
+{
+	TopnDecodedJsonb entries[TOPN_JSONB_CACHE_SIZE];
+} TopnJsonbCache;
 
 
 Datum topn(PG_FUNCTION_ARGS);
 Datum topn_add(PG_FUNCTION_ARGS);
+Datum topn_add_array(PG_FUNCTION_ARGS);
+Datum topn_add_weighted(PG_FUNCTION_ARGS);
 Datum topn_union(PG_FUNCTION_ARGS);
 Datum topn_add_trans(PG_FUNCTION_ARGS);
+Datum topn_add_weighted_trans(PG_FUNCTION_ARGS);
+Datum topn_add_typed_trans(PG_FUNCTION_ARGS);
+Datum topn_remove_trans(PG_FUNCTION_ARGS);
+Datum topn_remove_weighted_trans(PG_FUNCTION_ARGS);
+Datum topn_remove_typed_trans(PG_FUNCTION_ARGS);
 Datum topn_union_trans(PG_FUNCTION_ARGS);
 Datum topn_pack(PG_FUNCTION_ARGS);
+Datum topn_moving_pack(PG_FUNCTION_ARGS);
+Datum topn_in(PG_FUNCTION_ARGS);
+Datum topn_out(PG_FUNCTION_ARGS);
+Datum topn_recv(PG_FUNCTION_ARGS);
+Datum topn_send(PG_FUNCTION_ARGS);
+Datum topn_to_jsonb(PG_FUNCTION_ARGS);
+Datum jsonb_to_topn(PG_FUNCTION_ARGS);
+Datum topn_sketch_topn(PG_FUNCTION_ARGS);
+Datum topn_with_error(PG_FUNCTION_ARGS);
+Datum topn_sketch_add(PG_FUNCTION_ARGS);
+Datum topn_sketch_add_array(PG_FUNCTION_ARGS);
+Datum topn_sketch_add_weighted(PG_FUNCTION_ARGS);
+Datum topn_sketch_union(PG_FUNCTION_ARGS);
+Datum topn_sketch_union_trans(PG_FUNCTION_ARGS);
+Datum topn_sketch_pack(PG_FUNCTION_ARGS);
+Datum topn_sketch_moving_pack(PG_FUNCTION_ARGS);
+Datum topn_sketch_empty(PG_FUNCTION_ARGS);
+Datum topn_compact(PG_FUNCTION_ARGS);
+Datum jsonb_topn_compact(PG_FUNCTION_ARGS);
+Datum topn_frequency(PG_FUNCTION_ARGS);
+Datum topn_sketch_frequency(PG_FUNCTION_ARGS);
+Datum topn_frequency_with_error(PG_FUNCTION_ARGS);
+Datum topn_stats(PG_FUNCTION_ARGS);
+Datum topn_stats_reset(PG_FUNCTION_ARGS);
+#if PG_VERSION_NUM >= 180000
+Datum topn_sketch_support(PG_FUNCTION_ARGS);
+#endif
 
 
 /* local functions forward declarations */
 void _PG_init(void);
 static void RegisterTopNConfigVariables(void);
-static FrequentTopnItem * FrequencyArrayFromJsonb(JsonbContainer *container);
+static FrequentTopnItem * FrequencyArrayFromJsonb(JsonbContainer *container,
+												  int *itemCount);
+static void DecodeJsonb(TopnDecodedJsonb *decodedJsonb, Jsonb *jsonb);
+static TopnDecodedJsonb * GetCachedDecodedJsonb(FunctionCallInfo fcinfo,
+												int argumentIndex, Jsonb *jsonb);
+static void MergeDecodedJsonbIntoTopnAggState(TopnDecodedJsonb *decodedJsonb,
+											  TopnAggState *topn);
 static TopnAggState * CreateTopnAggState(void);
 static void MergeJsonbIntoTopnAggState(Jsonb *jsonb, TopnAggState *topn);
-static int compareFrequentTopnItem(const void *item1, const void *item2);
-static Datum topnGetDatum(FrequentTopnItem *topnItem, TupleDesc tupleDescriptor);
-static void PruneHashTable(HTAB *hashTable, int itemLimit, int numberOfRemainingElements);
+static Frequency JsonbNumericGetFrequency(Numeric frequencyNumeric);
+static int compareTopnItemCandidate(const void *candidate1, const void *candidate2);
+static int compareFrequentTopnItemKey(const void *item1, const void *item2);
+static int compareTopnSketchItemFrequency(const void *item1, const void *item2);
+static TupleDesc CreateTopnTupleDescriptor(void);
+static HeapTuple topnGetTuple(FrequentTopnItem *topnItem, TupleDesc tupleDescriptor);
+static void InitTopnMaterializedResult(FunctionCallInfo fcinfo);
+static TopnSketchCallContext * CreateTopnSketchCallContext(FunctionCallInfo fcinfo,
+															FuncCallContext *functionCallContext,
+															Oid itemType);
+static Datum TopnSketchItemGetDatum(TopnSketchCallContext *sketchCallContext,
+									TopnSketchItem *item);
+static bool TopnItemKeysEqual(const TopnItemKey *itemKey1, const TopnItemKey *itemKey2);
+static void InitTopnItemKey(TopnItemKey *itemKey, uint8 keyType,
+							const char *keyData, uint32 keyLength);
+static void InitHashedTopnItemKey(TopnItemKey *itemKey, const char *keyData,
+								  uint32 keyLength, uint32 keyHash);
+static char * TopnKeyToCString(uint8 keyType, const char *keyData, uint32 keyLength);
+static uint32 TopnKeyTypeSize(uint8 keyType);
+static void EncodeInt8Key(int64 value, char *keyData);
+static int64 DecodeInt8Key(const char *keyData);
+static bool ParseInt8Key(const char *textData, uint32 textLength, char *keyData);
+static bool ParseUuidKey(const char *textData, uint32 textLength, char *keyData);
+static void FormatUuidKey(const char *keyData, char *textData);
+static int HexDigitValue(char digit);
+static uint32 TopnKeyLength(const char *keyData, int keyLength);
+static int CompareTopnKeys(const char *keyData1, uint32 keyLength1,
+						   const char *keyData2, uint32 keyLength2);
+static bool AddItemToTopnAggState(TopnAggState *topn, const char *keyData,
+								  uint32 keyLength, Frequency amount);
+static bool AddCachedItemToTopnAggState(TopnAggState *topn, const char *keyData,
+										uint32 keyLength, Frequency amount);
+static uint32 TopnFrontCacheIndex(const char *keyData, uint32 keyLength);
+static bool MergeItemIntoTopnAggState(TopnAggState *topn, const char *keyData,
+									  uint32 keyLength, Frequency amount,
+									  Frequency error, Frequency sourceEvictedTotal);
+static void AddTextArrayToTopnAggState(TopnAggState *topn, ArrayType *itemArray);
+static Frequency GetItemWeight(int64 weight);
+static uint8 GetTypedItemKeyType(FunctionCallInfo fcinfo);
+static uint32 EncodeTypedItemKey(uint8 keyType, Datum item, char *keyData);
+static void RemoveItemFromTopnAggState(TopnAggState *topn, const char *keyData,
+									   uint32 keyLength, Frequency amount);
+static void PrepareTopnAggStateKeyType(TopnAggState *topn, uint8 keyType);
+static bool MergeTypedItemIntoTopnAggState(TopnAggState *topn, uint8 keyType,
+										   const char *keyData, uint32 keyLength,
+										   Frequency amount, Frequency error,
+										   Frequency sourceEvictedTotal);
+static void ConvertTopnAggStateToText(TopnAggState *topn);
+static TopnCounterTable * CreateTopnHashTable(long initialSize);
+static FrequentTopnItem * TopnCounterTableSearch(TopnCounterTable *table,
+												 const TopnItemKey *itemKey, bool enter,
+												 bool *found);
+static void TopnCounterTableRemove(TopnCounterTable *table, FrequentTopnItem *item);
+static void ResizeTopnCounterTable(TopnCounterTable *table, uint32 slotCount);
+static uint32 FindEmptyTopnCounterSlot(TopnCounterTable *table, uint32 keyHash);
+static void TopnCounterTableSeqInit(TopnCounterTableIterator *iterator,
+								   TopnCounterTable *table);
+static FrequentTopnItem * TopnCounterTableSeqNext(TopnCounterTableIterator *iterator);
+static void DestroyTopnCounterTable(TopnCounterTable *table);
+static Size TopnCounterTableSize(long itemCount);
+static bool MergeItemKeyIntoTopnAggState(TopnAggState *topn, TopnItemKey *itemKey,
+										 Frequency amount, Frequency error,
+										 Frequency sourceEvictedTotal);
+static FrequentTopnItem * EnterItemKeyIntoTopnAggState(TopnAggState *topn,
+													   TopnItemKey *itemKey,
+													   Frequency amount, Frequency error,
+													   Frequency sourceEvictedTotal,
+													   bool *found);
+static void BeginTopnMerge(TopnAggState *topn, Frequency sourceEvictedTotal);
+static void EndTopnMerge(TopnAggState *topn, Frequency sourceEvictedTotal);
+static void FoldTopnErrorBase(TopnAggState *topn);
+static Frequency TopnItemError(TopnAggState *topn, FrequentTopnItem *item);
+static Frequency AddFrequencies(Frequency frequency1, Frequency frequency2);
+static Frequency AddSignedFrequencies(Frequency frequency1, Frequency frequency2);
+static void StoreTopnItemKey(TopnAggState *topn, TopnItemKey *itemKey);
+static void CompactTopnKeyArena(TopnAggState *topn);
+static TopnSketch * DatumGetTopnSketch(Datum datum);
+static void CheckTopnSketchVersion(TopnSketch *sketch);
+static ExpandedTopnSketch * CreateExpandedTopnSketch(void);
+static ExpandedTopnSketch * ExpandTopnSketch(TopnSketch *sketch);
+static ExpandedTopnSketch * DatumGetExpandedTopnSketch(Datum datum);
+static ExpandedTopnSketch * GetWritableTopnSketch(Datum datum);
+static TopnSketch * GetReadableTopnSketch(Datum datum);
+static void SetExpandedTopnSketch(ExpandedTopnSketch *expandedSketch, TopnSketch *sketch);
+static Size ExpandedTopnSketchFlatSize(ExpandedObjectHeader *header);
+static void FlattenExpandedTopnSketch(ExpandedObjectHeader *header, void *result,
+									  Size allocatedSize);
+static TopnSketch * CreateEmptyTopnSketch(int32 capacity);
+static TopnSketch * CompactTopnAggState(TopnAggState *topn, int32 capacity);
+static TopnSketch * EncodeCompactTopnSketch(TopnSketch *sketch);
+static TopnSketch * DecodeCompactTopnSketch(TopnSketch *compactSketch);
+static char * WriteVarint(char *buffer, uint64 value);
+static const char * ReadVarint(const char *buffer, const char *bufferEnd, uint64 *value);
+static void MergeTopnSketchIntoTopnAggState(TopnSketch *sketch, TopnAggState *topn);
+static TopnSketch * MaterializeAggStateToTopnSketch(TopnAggState *topn);
+static void PruneHashTable(TopnAggState *topn, int itemLimit,
+						   int numberOfRemainingElements);
+static void PruneTopnAggStateToCapacity(TopnAggState *topn);
+static TopnItemCandidate * SelectTopnItemCandidates(TopnAggState *topn, int selectCount);
+static TopnAggState * CopyMostFrequentCounters(TopnAggState *topn);
+static void UpdatePeakStateSize(TopnAggState *topn);
+static int32 TopnAggStateCapacity(TopnAggState *topn);
+static int32 TopnAggStateItemLimit(TopnAggState *topn);
+static int32 TopnSketchCapacity(TopnSketch *sketch);
+static void MergeTopnCapacity(TopnAggState *topn, int32 capacity, int32 unionFactor);
+static int32 GetTopnCapacity(int32 capacity);
+static void SelectMostFrequentElements(void *elementArray, int elementCount,
+									   Size elementSize, int selectCount,
+									   int (*compare)(const void *, const void *));
+static void SwapElements(char *element1, char *element2, Size elementSize);
 static Jsonb * MaterializeAggStateToJsonb(TopnAggState *topn);
-static HTAB * topnHashtable(TopnAggState *topn);
+static TopnCounterTable * topnHashtable(TopnAggState *topn);
+static long TopnAggStateItemCount(TopnAggState *topn);
 static void MergeTopn(TopnAggState *left, TopnAggState *right);
 static void IncreaseItemFrequency(FrequentTopnItem *item, Frequency amount);
-static void InsertPairs(FrequentTopnItem *item, StringInfo jsonbStr);
-static Jsonb * jsonb_from_cstring(char *json, int len);
+static void IncreaseSketchItemFrequency(TopnSketchItem *item, Frequency amount);
+static bool FindTopnSketchItem(TopnSketch *sketch, const char *keyData,
+							   uint32 keyLength, int *itemIndex);
+static bool LookupTopnSketchItem(FunctionCallInfo fcinfo, TopnSketchItem *foundItem,
+								 Frequency *evictedTotal);
+static bool GetTopnLookupKey(FunctionCallInfo fcinfo, uint8 keyType, char *keyBuffer,
+							 const char **keyData, uint32 *keyLength);
+static bool FindCompactTopnSketchItem(TopnSketch *sketch, const char *keyData,
+									  uint32 keyLength, TopnSketchItem *foundItem);
+static TopnSketch * AddTextToTopnSketch(TopnSketch *sketch, text *itemText,
+										Frequency amount);
+static TopnSketch * AddItemToTopnSketch(TopnSketch *sketch, const char *keyData,
+										uint32 keyLength, Frequency amount);
+static TopnSketch * CopyTopnSketchWithItem(TopnSketch *sketch, int insertIndex,
+										   const char *keyData, uint32 keyLength,
+										   Frequency frequency, Frequency error,
+										   int removeIndex);
+static Jsonb * CreateEmptyJsonb(void);
 static size_t checkStringLen(size_t len);
 
 /*
@@ -176,110 +666,93 @@ RegisterTopNConfigVariables(void)
 		PGC_USERSET,
 		0,
 		NULL, NULL, NULL);
+
+	DefineCustomBoolVariable(
+		"topn.compact_sketches",
+		gettext_noop("Stores the topn values built by topn_sketch_agg in the compact "
+					 "encoding."),
+		NULL,
+		&CompactSketches,
+		false,
+		PGC_USERSET,
+		0,
+		NULL, NULL, NULL);
 }
 
 
 /*
  * topn is a user-facing UDF which returns the top items and their frequencies.
- * It first gets the jsonb and converts it into an ordered array of
- * FrequentTopnItem which keeps Datums and the frequencies in the first call.
- * Then, it returns an item and its frequency according to call counter which are
- * all accumulated in a jsonb object.
+ * It gets the counters of the jsonb from the jsonb cache of its call site, so a
+ * jsonb which does not change between the calls is only decoded once. Only the
+ * most frequent n counters are selected and sorted, and they are returned as
+ * rows of a tuplestore.
  */
 Datum
 topn(PG_FUNCTION_ARGS)
 {
-	FuncCallContext *functionCallContext = NULL;
+	ReturnSetInfo *resultInfo = (ReturnSetInfo *) fcinfo->resultinfo;
 	Jsonb *jsonb = NULL;
+	TopnDecodedJsonb *decodedJsonb = NULL;
+	TopnItemCandidate *sortedCandidateArray = NULL;
 	int jsonbElementCount = 0;
-	int callCounter = 0;
-	int maxCallCounter = 0;
 	int itemCountToPrint = 0;
 	int desiredNToPrint = 0;
-	TupleDesc tupleDescriptor = NULL;
-
-	if (SRF_IS_FIRSTCALL())
-	{
-		MemoryContext oldcontext = NULL;
-		FrequentTopnItem *sortedTopnArray = NULL;
-		TupleDesc completeTupleDescriptor = NULL;
-		JsonbContainer *container;
-
-		functionCallContext = SRF_FIRSTCALL_INIT();
-		if (PG_ARGISNULL(0))
-		{
-			SRF_RETURN_DONE(functionCallContext);
-		}
-
-		oldcontext = MemoryContextSwitchTo(functionCallContext->multi_call_memory_ctx);
-
-		jsonb = PG_GETARG_JSONB(0);
-		container = &jsonb->root;
-
-		jsonbElementCount = JsonContainerSize(container);
-
-		/* if there is not any element in the array just return */
-		if (jsonbElementCount <= 0)
-		{
-			MemoryContextSwitchTo(oldcontext);
-			SRF_RETURN_DONE(functionCallContext);
-		}
-
-		desiredNToPrint = PG_GETARG_INT32(1);
-		if (desiredNToPrint > NumberOfCounters)
-		{
-			ereport(ERROR, (errmsg("desired number of counters is higher than the "
-								   "topn.number_of_counters variable")));
-		}
-		itemCountToPrint = Min(desiredNToPrint, jsonbElementCount);
-		functionCallContext->max_calls = itemCountToPrint;
+	int itemIndex = 0;
 
-		/* create an array to copy top-n items and sort them later */
+	InitTopnMaterializedResult(fcinfo);
 
-		sortedTopnArray = FrequencyArrayFromJsonb(container);
-
-		/* pass the sorted entries to the multi call context */
-		qsort(sortedTopnArray, jsonbElementCount, sizeof(FrequentTopnItem),
-			  compareFrequentTopnItem);
-		functionCallContext->user_fctx = sortedTopnArray;
+	if (PG_ARGISNULL(0))
+	{
+		return (Datum) 0;
+	}
 
-		/* pass the tuple descriptor to be returned to the multi call context*/
-		tupleDescriptor =
-#if PG_VERSION_NUM < 120000
-			CreateTemplateTupleDesc(2, false);
-#else
-			CreateTemplateTupleDesc(2);
-#endif
-		TupleDescInitEntry(tupleDescriptor, (AttrNumber) 1, "item",
-						   TEXTOID, -1, 0);
-		TupleDescInitEntry(tupleDescriptor, (AttrNumber) 2, "frequency",
-						   INT8OID, -1, 0);
-		completeTupleDescriptor = BlessTupleDesc(tupleDescriptor);
-		functionCallContext->tuple_desc = completeTupleDescriptor;
+	jsonb = PG_GETARG_JSONB(0);
+	jsonbElementCount = JsonContainerSize(&jsonb->root);
 
-		MemoryContextSwitchTo(oldcontext);
+	/* if there is not any element in the array just return */
+	if (jsonbElementCount <= 0)
+	{
+		return (Datum) 0;
 	}
 
-	functionCallContext = SRF_PERCALL_SETUP();
-	maxCallCounter = functionCallContext->max_calls;
-	callCounter = functionCallContext->call_cntr;
-
-	if (callCounter < maxCallCounter)
+	desiredNToPrint = PG_GETARG_INT32(1);
+	if (desiredNToPrint > NumberOfCounters)
 	{
-		FrequentTopnItem *sortedTopnArray = NULL;
-		Datum topnDatum = 0;
+		ereport(ERROR, (errmsg("desired number of counters is higher than the "
+							   "topn.number_of_counters variable")));
+	}
+	itemCountToPrint = Min(desiredNToPrint, jsonbElementCount);
 
-		sortedTopnArray =
-			&((FrequentTopnItem *) functionCallContext->user_fctx)[callCounter];
+	decodedJsonb = GetCachedDecodedJsonb(fcinfo, 0, jsonb);
 
-		topnDatum = topnGetDatum(sortedTopnArray, functionCallContext->tuple_desc);
+	/* the ties are ordered by the key order of the jsonb */
+	sortedCandidateArray = palloc(sizeof(TopnItemCandidate) * jsonbElementCount);
+	for (itemIndex = 0; itemIndex < jsonbElementCount; itemIndex++)
+	{
+		sortedCandidateArray[itemIndex].item = &decodedJsonb->itemArray[itemIndex];
+		sortedCandidateArray[itemIndex].order = itemIndex;
+	}
 
-		SRF_RETURN_NEXT(functionCallContext, topnDatum);
+	/* only the items to print are sorted */
+	if (itemCountToPrint > 0)
+	{
+		SelectMostFrequentElements(sortedCandidateArray, jsonbElementCount,
+								   sizeof(TopnItemCandidate), itemCountToPrint,
+								   compareTopnItemCandidate);
+		qsort(sortedCandidateArray, itemCountToPrint, sizeof(TopnItemCandidate),
+			  compareTopnItemCandidate);
 	}
-	else
+
+	for (itemIndex = 0; itemIndex < itemCountToPrint; itemIndex++)
 	{
-		SRF_RETURN_DONE(functionCallContext);
+		tuplestore_puttuple(resultInfo->setResult,
+							topnGetTuple(sortedCandidateArray[itemIndex].item,
+										 resultInfo->setDesc));
 	}
+
+	pfree(sortedCandidateArray);
+
+	return (Datum) 0;
 }
 
 
@@ -290,12 +763,10 @@ topn(PG_FUNCTION_ARGS)
 Datum
 topn_add(PG_FUNCTION_ARGS)
 {
-	FrequentTopnItem *item = NULL;
 	Jsonb *jsonb = NULL;
 	TopnAggState *stateTopn = NULL;
 	text *itemText = NULL;
-	bool found = false;
-	char itemString[MAX_KEYSIZE];
+	uint32 itemLength = 0;
 
 	/*
 	 * Create stateTopn when the first non-null item arrive by using the item's type.
@@ -304,7 +775,7 @@ topn_add(PG_FUNCTION_ARGS)
 	 */
 	if (PG_ARGISNULL(0) && PG_ARGISNULL(1))
 	{
-		jsonb = jsonb_from_cstring("{}", 2);
+		jsonb = CreateEmptyJsonb();
 
 		PG_RETURN_JSONB(jsonb);
 	}
@@ -312,7 +783,7 @@ topn_add(PG_FUNCTION_ARGS)
 	{
 		stateTopn = CreateTopnAggState();
 
-		jsonb = jsonb_from_cstring("{}", 2);
+		jsonb = CreateEmptyJsonb();
 	}
 	else if (PG_ARGISNULL(1))
 	{
@@ -334,25 +805,99 @@ topn_add(PG_FUNCTION_ARGS)
 
 	MergeJsonbIntoTopnAggState(jsonb, stateTopn);
 
-	itemText = PG_GETARG_TEXT_P(1);
-	text_to_cstring_buffer(itemText, itemString, MAX_KEYSIZE);
+	itemText = PG_GETARG_TEXT_PP(1);
+	itemLength = TopnKeyLength(VARDATA_ANY(itemText), VARSIZE_ANY_EXHDR(itemText));
 
-	item = hash_search(topnHashtable(stateTopn), (void *) itemString,
-					   HASH_ENTER, &found);
-	if (found)
+	if (AddItemToTopnAggState(stateTopn, VARDATA_ANY(itemText), itemLength, 1))
 	{
-		IncreaseItemFrequency(item, 1);
+		PruneTopnAggStateToCapacity(stateTopn);
 	}
-	else
+
+	jsonb = MaterializeAggStateToJsonb(stateTopn);
+
+	PG_RETURN_JSONB(jsonb);
+}
+
+
+/*
+ * topn_add_array is the topn_add variant which adds all items of the given text
+ * array to the jsonb object. The jsonb is parsed and built only once for the
+ * whole batch, and the counters are pruned after all items are added. NULL
+ * items in the array are skipped.
+ */
+Datum
+topn_add_array(PG_FUNCTION_ARGS)
+{
+	TopnAggState *stateTopn = NULL;
+
+	if (PG_ARGISNULL(1))
 	{
-		item->frequency = 1;
+		if (PG_ARGISNULL(0))
+		{
+			PG_RETURN_JSONB(CreateEmptyJsonb());
+		}
 
-		PruneHashTable(topnHashtable(stateTopn), NumberOfCounters, NumberOfCounters);
+		PG_RETURN_JSONB(PG_GETARG_JSONB(0));
 	}
 
-	jsonb = MaterializeAggStateToJsonb(stateTopn);
+	stateTopn = CreateTopnAggState();
 
-	PG_RETURN_JSONB(jsonb);
+	if (!PG_ARGISNULL(0))
+	{
+		MergeJsonbIntoTopnAggState(PG_GETARG_JSONB(0), stateTopn);
+	}
+
+	AddTextArrayToTopnAggState(stateTopn, PG_GETARG_ARRAYTYPE_P(1));
+	PruneTopnAggStateToCapacity(stateTopn);
+
+	PG_RETURN_JSONB(MaterializeAggStateToJsonb(stateTopn));
+}
+
+
+/*
+ * topn_add_weighted is the topn_add variant which adds the given weight to the
+ * frequency of the item instead of 1. A NULL or zero weight leaves the jsonb
+ * object as it is.
+ */
+Datum
+topn_add_weighted(PG_FUNCTION_ARGS)
+{
+	TopnAggState *stateTopn = NULL;
+	text *itemText = NULL;
+	uint32 itemLength = 0;
+	Frequency weight = 0;
+
+	if (!PG_ARGISNULL(2))
+	{
+		weight = GetItemWeight(PG_GETARG_INT64(2));
+	}
+
+	if (PG_ARGISNULL(1) || weight == 0)
+	{
+		if (PG_ARGISNULL(0))
+		{
+			PG_RETURN_JSONB(CreateEmptyJsonb());
+		}
+
+		PG_RETURN_JSONB(PG_GETARG_JSONB(0));
+	}
+
+	stateTopn = CreateTopnAggState();
+
+	if (!PG_ARGISNULL(0))
+	{
+		MergeJsonbIntoTopnAggState(PG_GETARG_JSONB(0), stateTopn);
+	}
+
+	itemText = PG_GETARG_TEXT_PP(1);
+	itemLength = TopnKeyLength(VARDATA_ANY(itemText), VARSIZE_ANY_EXHDR(itemText));
+
+	if (AddItemToTopnAggState(stateTopn, VARDATA_ANY(itemText), itemLength, weight))
+	{
+		PruneTopnAggStateToCapacity(stateTopn);
+	}
+
+	PG_RETURN_JSONB(MaterializeAggStateToJsonb(stateTopn));
 }
 
 
@@ -374,10 +919,10 @@ topn_union(PG_FUNCTION_ARGS)
 	/*allocate topn */
 	topn = CreateTopnAggState();
 
-	MergeJsonbIntoTopnAggState(jsonbLeft, topn);
-	MergeJsonbIntoTopnAggState(jsonbRight, topn);
+	MergeDecodedJsonbIntoTopnAggState(GetCachedDecodedJsonb(fcinfo, 0, jsonbLeft), topn);
+	MergeDecodedJsonbIntoTopnAggState(GetCachedDecodedJsonb(fcinfo, 1, jsonbRight), topn);
 
-	PruneHashTable(topnHashtable(topn), NumberOfCounters, NumberOfCounters);
+	PruneTopnAggStateToCapacity(topn);
 
 	result = MaterializeAggStateToJsonb(topn);
 
@@ -388,7 +933,7 @@ topn_union(PG_FUNCTION_ARGS)
 /*
  * topn_add_trans function is the transient function for topn_add_agg.
  * In the first call, it initializes a Topn object and aggregates the
- * data in it by using the HASH_ENTER of hash table.
+ * data in its counter table.
  */
 Datum
 topn_add_trans(PG_FUNCTION_ARGS)
@@ -396,10 +941,8 @@ topn_add_trans(PG_FUNCTION_ARGS)
 	MemoryContext aggctx;
 	MemoryContext oldContext;
 	TopnAggState *topnTrans;
-	FrequentTopnItem *item = NULL;
 	text *textInput = NULL;
-	bool found = false;
-	char charInput[MAX_KEYSIZE];
+	uint32 inputLength = 0;
 
 	/* We must be called as a transition routine or we fail. */
 	if (!AggCheckCallContext(fcinfo, &aggctx))
@@ -414,6 +957,7 @@ topn_add_trans(PG_FUNCTION_ARGS)
 	{
 		oldContext = MemoryContextSwitchTo(aggctx);
 		topnTrans = CreateTopnAggState();
+		topnTrans->capacity = NumberOfCounters;
 		MemoryContextSwitchTo(oldContext);
 	}
 	else
@@ -428,21 +972,15 @@ topn_add_trans(PG_FUNCTION_ARGS)
 
 	/* Is the second argument non-null? */
 
-	textInput = PG_GETARG_TEXT_P(1);
+	textInput = PG_GETARG_TEXT_PP(1);
+	inputLength = TopnKeyLength(VARDATA_ANY(textInput), VARSIZE_ANY_EXHDR(textInput));
 
-	text_to_cstring_buffer(textInput, charInput, MAX_KEYSIZE);
-	item = hash_search(topnHashtable(topnTrans), (void *) charInput, HASH_ENTER, &found);
-	if (found)
-	{
-		IncreaseItemFrequency(item, 1);
-	}
-	else
+	if (AddCachedItemToTopnAggState(topnTrans, VARDATA_ANY(textInput), inputLength, 1))
 	{
-		int itemLimit = NumberOfCounters * UnionFactor;
-		int remainingElements = hash_get_num_entries(topnHashtable(topnTrans)) / 2;
-		item->frequency = 1;
+		int itemLimit = TopnAggStateItemLimit(topnTrans);
+		int remainingElements = TopnAggStateItemCount(topnTrans) / 2;
 
-		PruneHashTable(topnHashtable(topnTrans), itemLimit, remainingElements);
+		PruneHashTable(topnTrans, itemLimit, remainingElements);
 	}
 
 	PG_RETURN_POINTER(topnTrans);
@@ -450,35 +988,43 @@ topn_add_trans(PG_FUNCTION_ARGS)
 
 
 /*
- * topn_union_trans function is the transient function for topn_union_agg.
- * In the first call, it initializes a Topn and aggregates the jsonb
- * objects in it by using the HASH_ENTER of hash table.
+ * topn_add_weighted_trans function is the transient function for the weighted
+ * topn_add_agg. It works like topn_add_trans, but adds the weight given in the
+ * third argument to the frequency of the item. The rows with a NULL or zero
+ * weight are skipped. The variant with a fourth argument sets the capacity of
+ * the counter instead of topn.number_of_counters.
  */
 Datum
-topn_union_trans(PG_FUNCTION_ARGS)
+topn_add_weighted_trans(PG_FUNCTION_ARGS)
 {
 	MemoryContext aggctx;
 	MemoryContext oldContext;
 	TopnAggState *topnTrans;
-	TopnAggState *topnNewItem;
-	Jsonb *jsonbToBeAdded = NULL;
+	text *textInput = NULL;
+	uint32 inputLength = 0;
+	Frequency weight = 0;
 
-	/* it must be called as a transition routine or it fails */
+	/* We must be called as a transition routine or we fail. */
 	if (!AggCheckCallContext(fcinfo, &aggctx))
 	{
 		ereport(ERROR,
 				(errcode(ERRCODE_DATA_EXCEPTION),
-				 errmsg("topn_union_trans outside transition context")));
+				 errmsg("topn_add_weighted_trans outside transition context")));
 	}
 
 	/*
-	 * If the first argument is a NULL on first call, init an empty topn.
-	 * Otherwise, take the given argument and continue the process on it.
+	 * If the first argument is a NULL on first call, init an empty topn. Its
+	 * capacity is given in the optional fourth argument.
 	 */
 	if (PG_ARGISNULL(0))
 	{
 		oldContext = MemoryContextSwitchTo(aggctx);
 		topnTrans = CreateTopnAggState();
+		topnTrans->capacity = NumberOfCounters;
+		if (PG_NARGS() > 3 && !PG_ARGISNULL(3))
+		{
+			topnTrans->capacity = GetTopnCapacity(PG_GETARG_INT32(3));
+		}
 		MemoryContextSwitchTo(oldContext);
 	}
 	else
@@ -486,17 +1032,27 @@ topn_union_trans(PG_FUNCTION_ARGS)
 		topnTrans = (TopnAggState *) (PG_GETARG_POINTER(0));
 	}
 
-	if (!PG_ARGISNULL(1))
+	if (PG_ARGISNULL(1) || PG_ARGISNULL(2))
 	{
-		jsonbToBeAdded = PG_GETARG_JSONB(1);
-		topnNewItem = CreateTopnAggState();
+		PG_RETURN_POINTER(topnTrans);
+	}
 
-		MergeJsonbIntoTopnAggState(jsonbToBeAdded, topnNewItem);
+	weight = GetItemWeight(PG_GETARG_INT64(2));
+	if (weight == 0)
+	{
+		PG_RETURN_POINTER(topnTrans);
+	}
+
+	textInput = PG_GETARG_TEXT_PP(1);
+	inputLength = TopnKeyLength(VARDATA_ANY(textInput), VARSIZE_ANY_EXHDR(textInput));
 
-		/* always merges the right one into the left */
-		MergeTopn(topnTrans, topnNewItem);
+	if (AddCachedItemToTopnAggState(topnTrans, VARDATA_ANY(textInput), inputLength,
+									weight))
+	{
+		int itemLimit = TopnAggStateItemLimit(topnTrans);
+		int remainingElements = TopnAggStateItemCount(topnTrans) / 2;
 
-		/* No need to check the size again since it is already checked in MergeTopn */
+		PruneHashTable(topnTrans, itemLimit, remainingElements);
 	}
 
 	PG_RETURN_POINTER(topnTrans);
@@ -504,58 +1060,381 @@ topn_union_trans(PG_FUNCTION_ARGS)
 
 
 /*
- * topn_serialize function converts TopnAggState to bytea
+ * topn_add_typed_trans function is the transient function for the topn_add_agg
+ * and topn_sketch_agg aggregates of bigint and uuid items. The items are kept
+ * in their binary form, so they are not converted into text for every row.
  */
 Datum
-topn_serialize(PG_FUNCTION_ARGS)
+topn_add_typed_trans(PG_FUNCTION_ARGS)
 {
-	Size topnArraySize;
-	TopnAggState *topnTrans = (TopnAggState *) PG_GETARG_POINTER(0);
-	HASH_SEQ_STATUS status;
-	FrequentTopnItem *currentTask = NULL;
-	bytea *ret;
-	char *bpPtr; /* Cursor for writing into ret */
-	long hashTableSize = hash_get_num_entries(topnHashtable(topnTrans));
+	MemoryContext aggctx;
+	MemoryContext oldContext;
+	TopnAggState *topnTrans;
+	char keyData[UUID_LEN];
+	uint32 keyLength = 0;
+	uint8 keyType = TOPN_KEY_TEXT;
 
-	/* it must be called as a transition routine or it fails */
-	if (!AggCheckCallContext(fcinfo, NULL))
+	/* We must be called as a transition routine or we fail. */
+	if (!AggCheckCallContext(fcinfo, &aggctx))
 	{
 		ereport(ERROR,
 				(errcode(ERRCODE_DATA_EXCEPTION),
-				 errmsg("topn_serialize outside transition context")));
+				 errmsg("topn_add_typed_trans outside transition context")));
 	}
 
-	topnArraySize = sizeof(FrequentTopnItem) * hashTableSize;
-	ret = palloc(VARHDRSZ + topnArraySize);
-	SET_VARSIZE(ret, VARHDRSZ + topnArraySize);
-	bpPtr = (void *) VARDATA(ret);
+	keyType = GetTypedItemKeyType(fcinfo);
+
+	/* If the first argument is a NULL on first call, init an empty topn */
+	if (PG_ARGISNULL(0))
+	{
+		oldContext = MemoryContextSwitchTo(aggctx);
+		topnTrans = CreateTopnAggState();
+		topnTrans->keyType = keyType;
+		topnTrans->capacity = NumberOfCounters;
+		MemoryContextSwitchTo(oldContext);
+	}
+	else
+	{
+		topnTrans = (TopnAggState *) (PG_GETARG_POINTER(0));
+	}
+
+	if (PG_ARGISNULL(1))
+	{
+		PG_RETURN_POINTER(topnTrans);
+	}
 
-	hash_seq_init(&status, topnHashtable(topnTrans));
+	keyLength = EncodeTypedItemKey(keyType, PG_GETARG_DATUM(1), keyData);
 
-	while ((currentTask = (FrequentTopnItem *) hash_seq_search(&status)) != NULL)
+	if (AddCachedItemToTopnAggState(topnTrans, keyData, keyLength, 1))
 	{
-		memcpy(bpPtr, currentTask, sizeof(FrequentTopnItem));
-		bpPtr += sizeof(FrequentTopnItem);
+		int itemLimit = TopnAggStateItemLimit(topnTrans);
+		int remainingElements = TopnAggStateItemCount(topnTrans) / 2;
+
+		PruneHashTable(topnTrans, itemLimit, remainingElements);
 	}
 
-	PG_RETURN_BYTEA_P(ret);
+	PG_RETURN_POINTER(topnTrans);
 }
 
 
 /*
- * topn_deserialize function converts bytea to TopnAggState
+ * topn_remove_trans function is the inverse transition function of
+ * topn_add_agg and topn_sketch_agg when they are used as moving aggregates in
+ * a window. It decreases the frequency of the item leaving the window frame and
+ * removes its counter when the frequency drops to zero. This is only exact as
+ * long as no counter was pruned: a pruned item which is added again gets a new
+ * counter that never counted the rows which are leaving the frame. So once the
+ * state has pruned anything, NULL is returned, and the frame is aggregated from
+ * scratch, which gives the same result as the aggregate without a window.
  */
 Datum
-topn_deserialize(PG_FUNCTION_ARGS)
+topn_remove_trans(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggctx;
+	TopnAggState *topnTrans;
+	text *textInput = NULL;
+	uint32 inputLength = 0;
+
+	/* We must be called as a transition routine or we fail. */
+	if (!AggCheckCallContext(fcinfo, &aggctx))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_EXCEPTION),
+				 errmsg("topn_remove_trans outside transition context")));
+	}
+
+	/* the frame is aggregated from scratch if there is no state to remove from */
+	if (PG_ARGISNULL(0))
+	{
+		PG_RETURN_NULL();
+	}
+
+	topnTrans = (TopnAggState *) (PG_GETARG_POINTER(0));
+
+	/* the counts of a pruned state cannot be taken back */
+	if (topnTrans->evictedTotal > 0)
+	{
+		PG_RETURN_NULL();
+	}
+
+	if (!PG_ARGISNULL(1))
+	{
+		textInput = PG_GETARG_TEXT_PP(1);
+		inputLength = TopnKeyLength(VARDATA_ANY(textInput),
+									VARSIZE_ANY_EXHDR(textInput));
+
+		RemoveItemFromTopnAggState(topnTrans, VARDATA_ANY(textInput), inputLength, 1);
+	}
+
+	PG_RETURN_POINTER(topnTrans);
+}
+
+
+/*
+ * topn_remove_weighted_trans function is the inverse transition function of
+ * the weighted topn_add_agg and topn_sketch_agg. It works like
+ * topn_remove_trans, but subtracts the weight of the row.
+ */
+Datum
+topn_remove_weighted_trans(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggctx;
+	TopnAggState *topnTrans;
+	text *textInput = NULL;
+	uint32 inputLength = 0;
+	Frequency weight = 0;
+
+	/* We must be called as a transition routine or we fail. */
+	if (!AggCheckCallContext(fcinfo, &aggctx))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_EXCEPTION),
+				 errmsg("topn_remove_weighted_trans outside transition context")));
+	}
+
+	if (PG_ARGISNULL(0))
+	{
+		PG_RETURN_NULL();
+	}
+
+	topnTrans = (TopnAggState *) (PG_GETARG_POINTER(0));
+
+	if (topnTrans->evictedTotal > 0)
+	{
+		PG_RETURN_NULL();
+	}
+
+	if (PG_ARGISNULL(1) || PG_ARGISNULL(2))
+	{
+		PG_RETURN_POINTER(topnTrans);
+	}
+
+	weight = GetItemWeight(PG_GETARG_INT64(2));
+	if (weight == 0)
+	{
+		PG_RETURN_POINTER(topnTrans);
+	}
+
+	textInput = PG_GETARG_TEXT_PP(1);
+	inputLength = TopnKeyLength(VARDATA_ANY(textInput), VARSIZE_ANY_EXHDR(textInput));
+
+	RemoveItemFromTopnAggState(topnTrans, VARDATA_ANY(textInput), inputLength, weight);
+
+	PG_RETURN_POINTER(topnTrans);
+}
+
+
+/*
+ * topn_remove_typed_trans function is the inverse transition function of the
+ * topn_add_agg and topn_sketch_agg aggregates of bigint and uuid items.
+ */
+Datum
+topn_remove_typed_trans(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggctx;
+	TopnAggState *topnTrans;
+	char keyData[UUID_LEN];
+	uint32 keyLength = 0;
+	uint8 keyType = TOPN_KEY_TEXT;
+
+	/* We must be called as a transition routine or we fail. */
+	if (!AggCheckCallContext(fcinfo, &aggctx))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_EXCEPTION),
+				 errmsg("topn_remove_typed_trans outside transition context")));
+	}
+
+	keyType = GetTypedItemKeyType(fcinfo);
+
+	if (PG_ARGISNULL(0))
+	{
+		PG_RETURN_NULL();
+	}
+
+	topnTrans = (TopnAggState *) (PG_GETARG_POINTER(0));
+
+	if (topnTrans->evictedTotal > 0)
+	{
+		PG_RETURN_NULL();
+	}
+
+	if (!PG_ARGISNULL(1))
+	{
+		keyLength = EncodeTypedItemKey(keyType, PG_GETARG_DATUM(1), keyData);
+
+		RemoveItemFromTopnAggState(topnTrans, keyData, keyLength, 1);
+	}
+
+	PG_RETURN_POINTER(topnTrans);
+}
+
+
+/*
+ * topn_union_trans function is the transient function for topn_union_agg.
+ * In the first call, it initializes a Topn and aggregates the jsonb
+ * objects in its counter table.
+ */
+Datum
+topn_union_trans(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggctx;
+	MemoryContext oldContext;
+	TopnAggState *topnTrans;
+	Jsonb *jsonbToBeAdded = NULL;
+
+	/* it must be called as a transition routine or it fails */
+	if (!AggCheckCallContext(fcinfo, &aggctx))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_EXCEPTION),
+				 errmsg("topn_union_trans outside transition context")));
+	}
+
+	/*
+	 * If the first argument is a NULL on first call, init an empty topn.
+	 * Otherwise, take the given argument and continue the process on it.
+	 */
+	if (PG_ARGISNULL(0))
+	{
+		oldContext = MemoryContextSwitchTo(aggctx);
+		topnTrans = CreateTopnAggState();
+		MemoryContextSwitchTo(oldContext);
+	}
+	else
+	{
+		topnTrans = (TopnAggState *) (PG_GETARG_POINTER(0));
+	}
+
+	if (!PG_ARGISNULL(1))
+	{
+		jsonbToBeAdded = PG_GETARG_JSONB(1);
+
+		/*
+		 * The counters are added into the transition state as the jsonb is
+		 * read, which also prunes it when needed.
+		 */
+		MergeJsonbIntoTopnAggState(jsonbToBeAdded, topnTrans);
+
+		PG_FREE_IF_COPY(jsonbToBeAdded, 1);
+	}
+
+	PG_RETURN_POINTER(topnTrans);
+}
+
+
+/*
+ * topn_serialize function converts TopnAggState to bytea. The header keeps the
+ * format version, the type of the keys, the capacity, the union factor, the
+ * number of counters and the evicted total. Then, each counter is written as
+ * its frequency, its error, the hash and the length of its key and the key
+ * bytes. The counts and the lengths are varints, so small counts take a single
+ * byte, and the size of the result follows the real length of the keys. The
+ * length is left out for the fixed size typed keys. The hash is kept so that
+ * the keys do not need to be hashed again when the state is deserialized. The
+ * buffer is sized from the number of counters and the size of the key arena,
+ * so the counters are only visited once.
+ */
+Datum
+topn_serialize(PG_FUNCTION_ARGS)
+{
+	Size serializedSize = 0;
+	Size itemMaximumSize = 0;
+	long itemCount = 0;
+	TopnAggState *topnTrans = (TopnAggState *) PG_GETARG_POINTER(0);
+	TopnCounterTableIterator iterator;
+	FrequentTopnItem *currentTask = NULL;
+	bytea *ret;
+	char *bpPtr; /* Cursor for writing into ret */
+	uint32 fixedKeySize = TopnKeyTypeSize(topnTrans->keyType);
+
+	/* it must be called as a transition routine or it fails */
+	if (!AggCheckCallContext(fcinfo, NULL))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_EXCEPTION),
+				 errmsg("topn_serialize outside transition context")));
+	}
+
+	UpdatePeakStateSize(topnTrans);
+
+	/*
+	 * The keys which are not inline are exactly the ones in the key arena, and
+	 * the inline keys are bounded by the inline area.
+	 */
+	itemCount = TopnAggStateItemCount(topnTrans);
+	itemMaximumSize = 2 * TOPN_VARINT_MAX_SIZE + sizeof(uint32);
+	if (fixedKeySize == 0)
+	{
+		itemMaximumSize += TOPN_VARINT_MAX_SIZE + TOPN_INLINE_KEY_SIZE;
+	}
+	else
+	{
+		itemMaximumSize += Min(TOPN_INLINE_KEY_SIZE, fixedKeySize);
+	}
+
+	serializedSize = TOPN_SERIALIZED_HEADER_MAX_SIZE + itemCount * itemMaximumSize +
+					 topnTrans->liveKeySize;
+
+	ret = palloc(VARHDRSZ + serializedSize);
+	bpPtr = (void *) VARDATA(ret);
+
+	*bpPtr++ = TOPN_SERIALIZED_VERSION;
+	*bpPtr++ = topnTrans->keyType;
+	bpPtr = WriteVarint(bpPtr, (uint64) topnTrans->capacity);
+	bpPtr = WriteVarint(bpPtr, (uint64) topnTrans->unionFactor);
+	bpPtr = WriteVarint(bpPtr, (uint64) itemCount);
+	bpPtr = WriteVarint(bpPtr, (uint64) topnTrans->evictedTotal);
+
+	if (itemCount > 0)
+	{
+		TopnCounterTableSeqInit(&iterator, topnHashtable(topnTrans));
+		while ((currentTask = TopnCounterTableSeqNext(&iterator)) != NULL)
+		{
+			uint32 keyLength = currentTask->key.length;
+			Frequency error = TopnItemError(topnTrans, currentTask);
+
+			bpPtr = WriteVarint(bpPtr, (uint64) currentTask->frequency);
+			bpPtr = WriteVarint(bpPtr, (uint64) error);
+			memcpy(bpPtr, &currentTask->key.hash, sizeof(uint32));
+			bpPtr += sizeof(uint32);
+			if (fixedKeySize == 0)
+			{
+				bpPtr = WriteVarint(bpPtr, keyLength);
+			}
+			memcpy(bpPtr, TopnItemKeyData(&currentTask->key), keyLength);
+			bpPtr += keyLength;
+		}
+	}
+
+	SET_VARSIZE(ret, bpPtr - (char *) ret);
+
+	PG_RETURN_BYTEA_P(ret);
+}
+
+
+/*
+ * topn_deserialize function converts bytea to TopnAggState. The header is
+ * checked first, and the counter table is created with room for all the
+ * counters, so it does not grow while they are inserted. Every counter is
+ * checked against the end of the data, and the number of counters has to match
+ * the header.
+ */
+Datum
+topn_deserialize(PG_FUNCTION_ARGS)
 {
 	MemoryContext aggctx;
 	MemoryContext oldContext;
 	TopnAggState *topnTrans;
 	bytea *bp = PG_GETARG_BYTEA_P(0);
-	char *bpPtr;
-	char *bpPtrEnd;
-	FrequentTopnItem *item;
-	size_t bpsz;
+	const char *bpPtr;
+	const char *bpPtrEnd;
+	uint32 fixedKeySize = 0;
+	uint64 capacity = 0;
+	uint64 unionFactor = 0;
+	uint64 itemCount = 0;
+	uint64 evictedTotal = 0;
+	uint64 itemIndex = 0;
 
 	/* it must be called as a transition routine or it fails */
 	if (!AggCheckCallContext(fcinfo, &aggctx))
@@ -565,19 +1444,93 @@ topn_deserialize(PG_FUNCTION_ARGS)
 				 errmsg("topn_deserialize outside transition context")));
 	}
 
+	bpPtr = VARDATA(bp);
+	bpPtrEnd = bpPtr + VARSIZE(bp) - VARHDRSZ;
+	if (bpPtrEnd - bpPtr < 2 * sizeof(uint8) ||
+		(uint8) bpPtr[0] != TOPN_SERIALIZED_VERSION || (uint8) bpPtr[1] > TOPN_KEY_UUID)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid serialized topn state")));
+	}
+
 	oldContext = MemoryContextSwitchTo(aggctx);
 	topnTrans = CreateTopnAggState();
-	MemoryContextSwitchTo(oldContext);
-	bpsz = VARSIZE(bp) - VARHDRSZ;
 
-	for (bpPtr = VARDATA(bp), bpPtrEnd = bpPtr + bpsz;
-		 bpPtr < bpPtrEnd;
-		 bpPtr += sizeof(FrequentTopnItem))
+	topnTrans->keyType = (uint8) bpPtr[1];
+	fixedKeySize = TopnKeyTypeSize(topnTrans->keyType);
+	bpPtr += 2 * sizeof(uint8);
+
+	bpPtr = ReadVarint(bpPtr, bpPtrEnd, &capacity);
+	bpPtr = ReadVarint(bpPtr, bpPtrEnd, &unionFactor);
+	bpPtr = ReadVarint(bpPtr, bpPtrEnd, &itemCount);
+	bpPtr = ReadVarint(bpPtr, bpPtrEnd, &evictedTotal);
+	if (capacity > JSONB_MAX_PAIRS || unionFactor > PG_INT32_MAX ||
+		evictedTotal > MAX_FREQUENCY ||
+		itemCount > (bpPtrEnd - bpPtr) / TOPN_SERIALIZED_ITEM_MIN_SIZE)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid serialized topn state")));
+	}
+
+	topnTrans->capacity = (int32) capacity;
+	topnTrans->unionFactor = (int32) unionFactor;
+
+	if (itemCount > 0)
+	{
+		topnTrans->hashTable = CreateTopnHashTable((long) itemCount);
+	}
+
+	for (itemIndex = 0; itemIndex < itemCount; itemIndex++)
+	{
+		uint64 frequency = 0;
+		uint64 error = 0;
+		uint64 keyLength = fixedKeySize;
+		uint32 keyHash = 0;
+		TopnItemKey itemKey;
+
+		bpPtr = ReadVarint(bpPtr, bpPtrEnd, &frequency);
+		bpPtr = ReadVarint(bpPtr, bpPtrEnd, &error);
+		if (frequency > MAX_FREQUENCY || error > MAX_FREQUENCY ||
+			bpPtrEnd - bpPtr < sizeof(uint32))
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("invalid serialized topn state")));
+		}
+
+		memcpy(&keyHash, bpPtr, sizeof(uint32));
+		bpPtr += sizeof(uint32);
+		if (fixedKeySize == 0)
+		{
+			bpPtr = ReadVarint(bpPtr, bpPtrEnd, &keyLength);
+		}
+
+		if (keyLength > bpPtrEnd - bpPtr)
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("invalid serialized topn state")));
+		}
+
+		InitHashedTopnItemKey(&itemKey, bpPtr, (uint32) keyLength, keyHash);
+		MergeItemKeyIntoTopnAggState(topnTrans, &itemKey, (Frequency) frequency,
+									 (Frequency) error, 0);
+		bpPtr += keyLength;
+	}
+
+	if (bpPtr != bpPtrEnd)
 	{
-		item = hash_search(topnHashtable(topnTrans), bpPtr, HASH_ENTER, NULL);
-		memcpy(item, bpPtr, sizeof(FrequentTopnItem));
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid serialized topn state")));
 	}
 
+	topnTrans->evictedTotal = (Frequency) evictedTotal;
+
+	MemoryContextSwitchTo(oldContext);
+
 	PG_RETURN_POINTER(topnTrans);
 }
 
@@ -601,10 +1554,16 @@ topn_union_internal(PG_FUNCTION_ARGS)
 	}
 
 	/*
-	 * If the first argument is a NULL on first call, init an empty topn.
-	 * Otherwise, take the given argument and continue the process on it.
+	 * If the first argument is a NULL on first call, the second state is taken
+	 * as it is, since topn_deserialize creates it in the aggregate context, and
+	 * an empty topn is only created if both are NULL. Otherwise, take the given
+	 * argument and continue the process on it.
 	 */
-	if (PG_ARGISNULL(0))
+	if (PG_ARGISNULL(0) && !PG_ARGISNULL(1))
+	{
+		PG_RETURN_POINTER(PG_GETARG_POINTER(1));
+	}
+	else if (PG_ARGISNULL(0))
 	{
 		oldContext = MemoryContextSwitchTo(aggctx);
 		topnTrans = CreateTopnAggState();
@@ -626,8 +1585,8 @@ topn_union_internal(PG_FUNCTION_ARGS)
 
 
 /*
- * the packer function for aggregate functions it basically transforms the HTAB object
- * to a JSONB object and returns it to the user.
+ * the packer function for aggregate functions it basically transforms the counter
+ * table to a JSONB object and returns it to the user.
  */
 Datum
 topn_pack(PG_FUNCTION_ARGS)
@@ -635,7 +1594,6 @@ topn_pack(PG_FUNCTION_ARGS)
 	MemoryContext aggctx;
 	Jsonb *jsonb = NULL;
 	TopnAggState *topnTrans;
-	StringInfo emptyJsonb = NULL;
 
 	/* We must be called as a transition routine or we fail. */
 	if (!AggCheckCallContext(fcinfo, &aggctx))
@@ -649,15 +1607,12 @@ topn_pack(PG_FUNCTION_ARGS)
 	if (!PG_ARGISNULL(0))
 	{
 		topnTrans = (TopnAggState *) PG_GETARG_POINTER(0);
-		PruneHashTable(topnHashtable(topnTrans), NumberOfCounters, NumberOfCounters);
+		PruneTopnAggStateToCapacity(topnTrans);
 		jsonb = MaterializeAggStateToJsonb(topnTrans);
 	}
 	else
 	{
-		emptyJsonb = makeStringInfo();
-		appendStringInfo(emptyJsonb, "{}");
-
-		jsonb = jsonb_from_cstring(emptyJsonb->data, emptyJsonb->len);
+		jsonb = CreateEmptyJsonb();
 	}
 
 	PG_RETURN_JSONB(jsonb);
@@ -665,537 +1620,4246 @@ topn_pack(PG_FUNCTION_ARGS)
 
 
 /*
- * FrequencyArrayFromJsonb function creates and returns a FrequencyItem array
- * from a given JSONB container.
+ * topn_moving_pack is the final function of topn_add_agg when it is used as a
+ * moving aggregate. The window keeps adding to and removing from the state after
+ * the final function is called, so the state is not pruned like topn_pack does.
+ * The counters which pruning would keep are copied and packed instead.
  */
-static FrequentTopnItem *
-FrequencyArrayFromJsonb(JsonbContainer *container)
+Datum
+topn_moving_pack(PG_FUNCTION_ARGS)
 {
-	Size topnArraySize = 0;
-	FrequentTopnItem *topnItemArray = NULL;
-	StringInfo key = NULL;
-	int jsonbElementCount = 0;
-	int topnIndex = 0;
-	JsonbIteratorToken jsonbIteratorToken;
-	JsonbValue itemJsonbValue;
-	JsonbIterator *iterator = NULL;
-	char *valueNumAsString = NULL;
-	Frequency frequencyValue = 0;
-
-	jsonbElementCount = JsonContainerSize(container);
-	topnArraySize = sizeof(FrequentTopnItem) * jsonbElementCount;
-	topnItemArray = (FrequentTopnItem *) palloc0(topnArraySize);
+	MemoryContext aggctx;
+	Jsonb *jsonb = NULL;
+	TopnAggState *topnCopy = NULL;
 
-	iterator = JsonbIteratorInit(container);
-	while ((jsonbIteratorToken = JsonbIteratorNext(&iterator, &itemJsonbValue, false)) !=
-		   WJB_DONE)
+	/* We must be called as a transition routine or we fail. */
+	if (!AggCheckCallContext(fcinfo, &aggctx))
 	{
-		if (jsonbIteratorToken == WJB_KEY && itemJsonbValue.type == jbvString)
-		{
-			/* json rules guarantee this is a string */
-			key = makeStringInfo();
-			appendBinaryStringInfo(key, itemJsonbValue.val.string.val,
-								   itemJsonbValue.val.string.len);
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_EXCEPTION),
+				 errmsg("topn_moving_pack outside aggregate context")));
+	}
 
-			if (key->len > MAX_KEYSIZE)
+	if (!PG_ARGISNULL(0))
+	{
+		topnCopy = CopyMostFrequentCounters((TopnAggState *) PG_GETARG_POINTER(0));
+	}
+	else
+	{
+		topnCopy = CreateTopnAggState();
+	}
+
+	jsonb = MaterializeAggStateToJsonb(topnCopy);
+
+	PG_RETURN_JSONB(jsonb);
+}
+
+/*
+ * topn_in is the input function of the topn type. It accepts the same textual
+ * format as the jsonb counters, i.e. a json object of ("key":value) pairs.
+ */
+Datum
+topn_in(PG_FUNCTION_ARGS)
+{
+	char *inputString = PG_GETARG_CSTRING(0);
+	Jsonb *jsonb = NULL;
+	TopnAggState *topn = NULL;
+
+	jsonb = DatumGetJsonbP(DirectFunctionCall1(jsonb_in, CStringGetDatum(inputString)));
+	if (!JB_ROOT_IS_OBJECT(jsonb))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("invalid input syntax for type topn: \"%s\"", inputString),
+				 errdetail("A topn value must be a json object of item frequencies.")));
+	}
+
+	topn = CreateTopnAggState();
+	MergeJsonbIntoTopnAggState(jsonb, topn);
+
+	PG_RETURN_TOPN_SKETCH(MaterializeAggStateToTopnSketch(topn));
+}
+
+
+/*
+ * topn_out is the output function of the topn type. The items are printed in
+ * the json object format which is also accepted by topn_in. The typed keys are
+ * printed with the output format of their type.
+ */
+Datum
+topn_out(PG_FUNCTION_ARGS)
+{
+	TopnSketch *sketch = PG_GETARG_TOPN_SKETCH(0);
+	StringInfo outputString = makeStringInfo();
+	char *keyData = TopnSketchKeyData(sketch);
+	int itemIndex = 0;
+
+	appendStringInfoChar(outputString, '{');
+
+	for (itemIndex = 0; itemIndex < sketch->itemCount; itemIndex++)
+	{
+		TopnSketchItem *item = &sketch->items[itemIndex];
+		char *key = TopnKeyToCString(TopnSketchKeyType(sketch),
+									 keyData + item->keyOffset, item->keyLength);
+
+		if (itemIndex > 0)
+		{
+			appendStringInfoString(outputString, ", ");
+		}
+
+		escape_json(outputString, key);
+		pfree(key);
+		appendStringInfo(outputString, ": " INT64_FORMAT, item->frequency);
+	}
+
+	appendStringInfoChar(outputString, '}');
+
+	PG_RETURN_CSTRING(outputString->data);
+}
+
+
+/*
+ * topn_recv is the binary input function of the topn type. The items are
+ * inserted into a TopnAggState first, so that duplicate and unsorted keys
+ * coming from the client end up in a valid sketch.
+ */
+Datum
+topn_recv(PG_FUNCTION_ARGS)
+{
+	StringInfo inputBuffer = (StringInfo) PG_GETARG_POINTER(0);
+	TopnAggState *topn = NULL;
+	int version = 0;
+	int flags = 0;
+	uint8 keyType = TOPN_KEY_TEXT;
+	int32 unionFactor = 0;
+	int32 capacity = 0;
+	int32 itemCount = 0;
+	int32 itemIndex = 0;
+	Frequency evictedTotal = 0;
+
+	version = pq_getmsgbyte(inputBuffer);
+	if (version != TOPN_SKETCH_VERSION)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("unsupported topn version number %d", version)));
+	}
+
+	flags = pq_getmsgbyte(inputBuffer);
+	keyType = flags & TOPN_SKETCH_KEY_TYPE_MASK;
+	if ((flags & ~TOPN_SKETCH_KEY_TYPE_MASK) != 0 || keyType > TOPN_KEY_UUID)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid flags in external topn value")));
+	}
+
+	unionFactor = (int32) pq_getmsgint(inputBuffer, 2);
+	capacity = (int32) pq_getmsgint(inputBuffer, 4);
+	if (unionFactor < 1 || capacity < 0 || capacity > JSONB_MAX_PAIRS)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid capacity in external topn value")));
+	}
+
+	itemCount = (int32) pq_getmsgint(inputBuffer, 4);
+	if (itemCount < 0)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid number of items in external topn value")));
+	}
+
+	evictedTotal = (Frequency) pq_getmsgint64(inputBuffer);
+	if (evictedTotal < 0)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid evicted total in external topn value")));
+	}
+
+	topn = CreateTopnAggState();
+	topn->keyType = keyType;
+	topn->capacity = capacity;
+	topn->unionFactor = unionFactor;
+
+	for (itemIndex = 0; itemIndex < itemCount; itemIndex++)
+	{
+		Frequency frequency = (Frequency) pq_getmsgint64(inputBuffer);
+		Frequency error = (Frequency) pq_getmsgint64(inputBuffer);
+		int32 keyLength = (int32) pq_getmsgint(inputBuffer, 4);
+		char *key = NULL;
+		int keyByteCount = 0;
+
+		if (error < 0)
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					 errmsg("invalid error in external topn value")));
+		}
+
+		if (keyLength < 0 || keyLength > inputBuffer->len - inputBuffer->cursor ||
+			(keyType != TOPN_KEY_TEXT && keyLength != TopnKeyTypeSize(keyType)))
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					 errmsg("invalid key length in external topn value")));
+		}
+
+		/* the typed keys are sent in their binary form */
+		if (keyType != TOPN_KEY_TEXT)
+		{
+			MergeItemIntoTopnAggState(topn, pq_getmsgbytes(inputBuffer, keyLength),
+									  keyLength, frequency, error, 0);
+			continue;
+		}
+
+		key = pq_getmsgtext(inputBuffer, keyLength, &keyByteCount);
+		if (keyByteCount > MAX_KEYSIZE)
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_EXCEPTION),
+					 errmsg("this topn object includes a key which is longer than "
+							"allowed topn key size (256 bytes)")));
+		}
+
+		MergeItemIntoTopnAggState(topn, key, keyByteCount, frequency, error, 0);
+		pfree(key);
+	}
+
+	topn->evictedTotal = evictedTotal;
+
+	PG_RETURN_TOPN_SKETCH(MaterializeAggStateToTopnSketch(topn));
+}
+
+
+/*
+ * topn_send is the binary output function of the topn type.
+ */
+Datum
+topn_send(PG_FUNCTION_ARGS)
+{
+	TopnSketch *sketch = PG_GETARG_TOPN_SKETCH(0);
+	char *keyData = TopnSketchKeyData(sketch);
+	StringInfoData outputBuffer;
+	int itemIndex = 0;
+
+	pq_begintypsend(&outputBuffer);
+	pq_sendbyte(&outputBuffer, sketch->version);
+	pq_sendbyte(&outputBuffer, sketch->flags);
+	pq_sendint16(&outputBuffer, sketch->unionFactor);
+	pq_sendint32(&outputBuffer, sketch->capacity);
+	pq_sendint32(&outputBuffer, sketch->itemCount);
+	pq_sendint64(&outputBuffer, sketch->evictedTotal);
+
+	for (itemIndex = 0; itemIndex < sketch->itemCount; itemIndex++)
+	{
+		TopnSketchItem *item = &sketch->items[itemIndex];
+		char *key = keyData + item->keyOffset;
+		char *clientKey = key;
+		int clientKeyLength = item->keyLength;
+
+		if (TopnSketchKeyType(sketch) == TOPN_KEY_TEXT)
+		{
+			clientKey = pg_server_to_client(key, item->keyLength);
+		}
+
+		/* the conversion result is NUL-terminated only if a conversion happened */
+		if (clientKey != key)
+		{
+			clientKeyLength = strlen(clientKey);
+		}
+
+		pq_sendint64(&outputBuffer, item->frequency);
+		pq_sendint64(&outputBuffer, item->error);
+		pq_sendint32(&outputBuffer, clientKeyLength);
+		pq_sendbytes(&outputBuffer, clientKey, clientKeyLength);
+	}
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&outputBuffer));
+}
+
+
+/*
+ * topn_to_jsonb converts a topn sketch into the jsonb counter format.
+ */
+Datum
+topn_to_jsonb(PG_FUNCTION_ARGS)
+{
+	TopnSketch *sketch = PG_GETARG_TOPN_SKETCH(0);
+	TopnAggState *topn = CreateTopnAggState();
+
+	MergeTopnSketchIntoTopnAggState(sketch, topn);
+
+	PG_RETURN_JSONB(MaterializeAggStateToJsonb(topn));
+}
+
+
+/*
+ * jsonb_to_topn converts a jsonb counter into a topn sketch.
+ */
+Datum
+jsonb_to_topn(PG_FUNCTION_ARGS)
+{
+	Jsonb *jsonb = PG_GETARG_JSONB(0);
+	TopnAggState *topn = CreateTopnAggState();
+
+	MergeJsonbIntoTopnAggState(jsonb, topn);
+
+	PG_RETURN_TOPN_SKETCH(MaterializeAggStateToTopnSketch(topn));
+}
+
+
+/*
+ * topn_sketch_topn is the topn() function for the topn type. The counts are
+ * read directly from the sketch, which spares us the jsonb iteration and the
+ * numeric parsing of the jsonb variant. When it is called with a third argument,
+ * the items are returned as the type of that argument instead of text.
+ */
+Datum
+topn_sketch_topn(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *functionCallContext = NULL;
+	int callCounter = 0;
+	int maxCallCounter = 0;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext = NULL;
+		Oid itemType = TEXTOID;
+
+		functionCallContext = SRF_FIRSTCALL_INIT();
+		if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+		{
+			SRF_RETURN_DONE(functionCallContext);
+		}
+
+		oldcontext = MemoryContextSwitchTo(functionCallContext->multi_call_memory_ctx);
+
+		if (PG_NARGS() > 2)
+		{
+			TupleDesc tupleDescriptor = NULL;
+
+			if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
 			{
 				ereport(ERROR,
-						(errcode(ERRCODE_DATA_EXCEPTION),
-						 errmsg("this jsonb object includes a key which is longer than "
-								"allowed topn key size (256 bytes)")));
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("function returning record called in context "
+								"that cannot accept type record")));
 			}
 
-			jsonbIteratorToken = JsonbIteratorNext(&iterator, &itemJsonbValue, false);
-			if (jsonbIteratorToken == WJB_VALUE && itemJsonbValue.type == jbvNumeric)
-			{
-				valueNumAsString = numeric_normalize(itemJsonbValue.val.numeric);
-				frequencyValue = atol(valueNumAsString);
-				memcpy(topnItemArray[topnIndex].key, key->data, key->len);
-				topnItemArray[topnIndex].frequency = frequencyValue;
+			itemType = get_fn_expr_argtype(fcinfo->flinfo, 2);
+			functionCallContext->tuple_desc = BlessTupleDesc(tupleDescriptor);
+		}
+		else
+		{
+			functionCallContext->tuple_desc = CreateTopnTupleDescriptor();
+		}
+
+		functionCallContext->user_fctx =
+			CreateTopnSketchCallContext(fcinfo, functionCallContext, itemType);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	functionCallContext = SRF_PERCALL_SETUP();
+	maxCallCounter = functionCallContext->max_calls;
+	callCounter = functionCallContext->call_cntr;
+
+	if (callCounter < maxCallCounter)
+	{
+		TopnSketchCallContext *sketchCallContext = functionCallContext->user_fctx;
+		TopnSketchItem *item = sketchCallContext->sortedItemArray[callCounter];
+		Datum values[2];
+		bool isNulls[2];
+		HeapTuple topnTuple = NULL;
+
+		memset(isNulls, false, sizeof(isNulls));
+
+		values[0] = TopnSketchItemGetDatum(sketchCallContext, item);
+		values[1] = Int64GetDatum(item->frequency);
+
+		topnTuple = heap_form_tuple(functionCallContext->tuple_desc, values, isNulls);
+
+		SRF_RETURN_NEXT(functionCallContext, HeapTupleGetDatum(topnTuple));
+	}
+	else
+	{
+		SRF_RETURN_DONE(functionCallContext);
+	}
+}
+
+
+/*
+ * topn_with_error is the topn() function for the topn type which also returns
+ * the bounds of the frequencies. The frequency of a counter is the lower bound,
+ * and adding the error of the counter gives the upper bound.
+ */
+Datum
+topn_with_error(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *functionCallContext = NULL;
+	int callCounter = 0;
+	int maxCallCounter = 0;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext = NULL;
+		TupleDesc tupleDescriptor = NULL;
+
+		functionCallContext = SRF_FIRSTCALL_INIT();
+		if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+		{
+			SRF_RETURN_DONE(functionCallContext);
+		}
+
+		oldcontext = MemoryContextSwitchTo(functionCallContext->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("function returning record called in context "
+							"that cannot accept type record")));
+		}
+
+		functionCallContext->tuple_desc = BlessTupleDesc(tupleDescriptor);
+		functionCallContext->user_fctx =
+			CreateTopnSketchCallContext(fcinfo, functionCallContext, TEXTOID);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	functionCallContext = SRF_PERCALL_SETUP();
+	maxCallCounter = functionCallContext->max_calls;
+	callCounter = functionCallContext->call_cntr;
+
+	if (callCounter < maxCallCounter)
+	{
+		TopnSketchCallContext *sketchCallContext = functionCallContext->user_fctx;
+		TopnSketchItem *item = sketchCallContext->sortedItemArray[callCounter];
+		Datum values[3];
+		bool isNulls[3];
+		HeapTuple topnTuple = NULL;
+
+		memset(isNulls, false, sizeof(isNulls));
+
+		values[0] = TopnSketchItemGetDatum(sketchCallContext, item);
+		values[1] = Int64GetDatum(item->frequency);
+		values[2] = Int64GetDatum(AddFrequencies(item->frequency, item->error));
+
+		topnTuple = heap_form_tuple(functionCallContext->tuple_desc, values, isNulls);
+
+		SRF_RETURN_NEXT(functionCallContext, HeapTupleGetDatum(topnTuple));
+	}
+	else
+	{
+		SRF_RETURN_DONE(functionCallContext);
+	}
+}
+
+
+/*
+ * CreateTopnSketchCallContext reads the sketch and the number of items to
+ * return of a topn() call for the topn type, and sorts the most frequent items
+ * of the sketch. The items are returned as the given type.
+ */
+static TopnSketchCallContext *
+CreateTopnSketchCallContext(FunctionCallInfo fcinfo,
+							FuncCallContext *functionCallContext, Oid itemType)
+{
+	TopnSketch *sketch = PG_GETARG_TOPN_SKETCH(0);
+	TopnSketchItem **sortedItemArray = NULL;
+	TopnSketchCallContext *sketchCallContext = NULL;
+	int itemCountToPrint = 0;
+	int desiredNToPrint = 0;
+	int itemIndex = 0;
+
+	sketchCallContext = palloc0(sizeof(TopnSketchCallContext));
+	sketchCallContext->sketch = sketch;
+	sketchCallContext->itemType = itemType;
+	getTypeInputInfo(itemType, &sketchCallContext->itemInputFunction,
+					 &sketchCallContext->itemInputParam);
+
+	/* if there is not any element in the sketch there is nothing to return */
+	if (sketch->itemCount <= 0)
+	{
+		functionCallContext->max_calls = 0;
+		return sketchCallContext;
+	}
+
+	desiredNToPrint = PG_GETARG_INT32(1);
+	if (desiredNToPrint > TopnSketchCapacity(sketch))
+	{
+		ereport(ERROR, (errmsg("desired number of counters is higher than the "
+							   "capacity of the topn value")));
+	}
+	itemCountToPrint = Min(desiredNToPrint, sketch->itemCount);
+	functionCallContext->max_calls = itemCountToPrint;
+
+	/*
+	 * Sort pointers to the items, the sketch itself stays in key order. Only
+	 * the items to print are selected and sorted.
+	 */
+	sortedItemArray = palloc(sizeof(TopnSketchItem *) * sketch->itemCount);
+	for (itemIndex = 0; itemIndex < sketch->itemCount; itemIndex++)
+	{
+		sortedItemArray[itemIndex] = &sketch->items[itemIndex];
+	}
+
+	if (itemCountToPrint > 0)
+	{
+		SelectMostFrequentElements(sortedItemArray, sketch->itemCount,
+								   sizeof(TopnSketchItem *), itemCountToPrint,
+								   compareTopnSketchItemFrequency);
+		qsort(sortedItemArray, itemCountToPrint, sizeof(TopnSketchItem *),
+			  compareTopnSketchItemFrequency);
+	}
+
+	sketchCallContext->sortedItemArray = sortedItemArray;
+
+	return sketchCallContext;
+}
+
+
+/*
+ * topn_sketch_add is the topn_add function for the topn type. It adds the
+ * given item to the sketch and returns the new sketch. The item is looked up
+ * in the sorted sketch directly, so the counters are only rebuilt when the
+ * sketch has more items than topn.number_of_counters allows. The sketch is
+ * returned as an expanded object, so that the next call which gets it as a
+ * read-write argument updates the found counter in place.
+ */
+Datum
+topn_sketch_add(PG_FUNCTION_ARGS)
+{
+	ExpandedTopnSketch *expandedSketch = NULL;
+	TopnSketch *sketch = NULL;
+
+	if (PG_ARGISNULL(0) && PG_ARGISNULL(1))
+	{
+		PG_RETURN_TOPN_SKETCH(CreateEmptyTopnSketch(0));
+	}
+	else if (PG_ARGISNULL(1))
+	{
+		PG_RETURN_TOPN_SKETCH(PG_GETARG_TOPN_SKETCH(0));
+	}
+	else if (PG_ARGISNULL(0))
+	{
+		expandedSketch = ExpandTopnSketch(CreateEmptyTopnSketch(0));
+	}
+	else
+	{
+		/* the found counter is updated in place, so work on a private sketch */
+		expandedSketch = GetWritableTopnSketch(PG_GETARG_DATUM(0));
+	}
+
+	sketch = AddTextToTopnSketch(expandedSketch->sketch, PG_GETARG_TEXT_PP(1), 1);
+	SetExpandedTopnSketch(expandedSketch, sketch);
+
+	PG_RETURN_EXPANDED_TOPN_SKETCH(expandedSketch);
+}
+
+
+/*
+ * topn_sketch_add_array is the topn_add_array function for the topn type.
+ */
+Datum
+topn_sketch_add_array(PG_FUNCTION_ARGS)
+{
+	TopnAggState *stateTopn = NULL;
+
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+		{
+			PG_RETURN_TOPN_SKETCH(CreateEmptyTopnSketch(0));
+		}
+
+		PG_RETURN_TOPN_SKETCH(PG_GETARG_TOPN_SKETCH(0));
+	}
+
+	stateTopn = CreateTopnAggState();
+
+	if (!PG_ARGISNULL(0))
+	{
+		MergeTopnSketchIntoTopnAggState(PG_GETARG_TOPN_SKETCH(0), stateTopn);
+	}
+
+	AddTextArrayToTopnAggState(stateTopn, PG_GETARG_ARRAYTYPE_P(1));
+	PruneTopnAggStateToCapacity(stateTopn);
+
+	PG_RETURN_TOPN_SKETCH(MaterializeAggStateToTopnSketch(stateTopn));
+}
+
+
+/*
+ * topn_sketch_add_weighted is the topn_add_weighted function for the topn type.
+ */
+Datum
+topn_sketch_add_weighted(PG_FUNCTION_ARGS)
+{
+	ExpandedTopnSketch *expandedSketch = NULL;
+	TopnSketch *sketch = NULL;
+	Frequency weight = 0;
+
+	if (!PG_ARGISNULL(2))
+	{
+		weight = GetItemWeight(PG_GETARG_INT64(2));
+	}
+
+	if (PG_ARGISNULL(1) || weight == 0)
+	{
+		if (PG_ARGISNULL(0))
+		{
+			PG_RETURN_TOPN_SKETCH(CreateEmptyTopnSketch(0));
+		}
+
+		PG_RETURN_TOPN_SKETCH(PG_GETARG_TOPN_SKETCH(0));
+	}
+	else if (PG_ARGISNULL(0))
+	{
+		expandedSketch = ExpandTopnSketch(CreateEmptyTopnSketch(0));
+	}
+	else
+	{
+		expandedSketch = GetWritableTopnSketch(PG_GETARG_DATUM(0));
+	}
+
+	sketch = AddTextToTopnSketch(expandedSketch->sketch, PG_GETARG_TEXT_PP(1), weight);
+	SetExpandedTopnSketch(expandedSketch, sketch);
+
+	PG_RETURN_EXPANDED_TOPN_SKETCH(expandedSketch);
+}
+
+
+/*
+ * topn_sketch_union is the topn_union function for the topn type. Expanded
+ * arguments are read without flattening them. The counters of both sketches
+ * are merged and the union is built as a new sketch, so a call takes time in
+ * proportion to the number of counters. The new sketch is built in the memory
+ * context of the result, which is the left argument if it is a read-write
+ * expanded sketch, so it is not copied again. Both sketches are read before the
+ * left one is replaced, so the same sketch may be given on both sides.
+ */
+Datum
+topn_sketch_union(PG_FUNCTION_ARGS)
+{
+	TopnSketch *sketchLeft = GetReadableTopnSketch(PG_GETARG_DATUM(0));
+	TopnSketch *sketchRight = GetReadableTopnSketch(PG_GETARG_DATUM(1));
+	TopnAggState *topn = CreateTopnAggState();
+	ExpandedTopnSketch *expandedSketch = NULL;
+	TopnSketch *oldSketch = NULL;
+	MemoryContext oldContext = NULL;
+
+	MergeTopnSketchIntoTopnAggState(sketchLeft, topn);
+	MergeTopnSketchIntoTopnAggState(sketchRight, topn);
+
+	PruneTopnAggStateToCapacity(topn);
+
+	if (VARATT_IS_EXTERNAL_EXPANDED_RW(DatumGetPointer(PG_GETARG_DATUM(0))))
+	{
+		expandedSketch = GetWritableTopnSketch(PG_GETARG_DATUM(0));
+	}
+	else
+	{
+		expandedSketch = CreateExpandedTopnSketch();
+	}
+
+	oldSketch = expandedSketch->sketch;
+
+	oldContext = MemoryContextSwitchTo(expandedSketch->header.eoh_context);
+	expandedSketch->sketch = MaterializeAggStateToTopnSketch(topn);
+	MemoryContextSwitchTo(oldContext);
+
+	if (oldSketch != NULL)
+	{
+		pfree(oldSketch);
+	}
+
+	PG_RETURN_EXPANDED_TOPN_SKETCH(expandedSketch);
+}
+
+
+/*
+ * topn_sketch_union_trans function is the transient function for the topn
+ * type variant of topn_union_agg. The items of the sketch are merged into the
+ * transition state directly.
+ */
+Datum
+topn_sketch_union_trans(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggctx;
+	MemoryContext oldContext;
+	TopnAggState *topnTrans;
+
+	/* it must be called as a transition routine or it fails */
+	if (!AggCheckCallContext(fcinfo, &aggctx))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_EXCEPTION),
+				 errmsg("topn_sketch_union_trans outside transition context")));
+	}
+
+	if (PG_ARGISNULL(0))
+	{
+		oldContext = MemoryContextSwitchTo(aggctx);
+		topnTrans = CreateTopnAggState();
+		MemoryContextSwitchTo(oldContext);
+	}
+	else
+	{
+		topnTrans = (TopnAggState *) (PG_GETARG_POINTER(0));
+	}
+
+	if (!PG_ARGISNULL(1))
+	{
+		TopnSketch *sketch = PG_GETARG_TOPN_SKETCH(1);
+
+		MergeTopnSketchIntoTopnAggState(sketch, topnTrans);
+
+		PG_FREE_IF_COPY(sketch, 1);
+	}
+
+	PG_RETURN_POINTER(topnTrans);
+}
+
+
+/*
+ * topn_sketch_pack is the final function of the aggregates which return the
+ * topn type. It prunes the counters and transforms them into a TopnSketch.
+ */
+Datum
+topn_sketch_pack(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggctx;
+	TopnSketch *sketch = NULL;
+	TopnAggState *topnTrans;
+
+	/* We must be called as a transition routine or we fail. */
+	if (!AggCheckCallContext(fcinfo, &aggctx))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_EXCEPTION),
+				 errmsg("topn_sketch_pack outside aggregate context")));
+	}
+
+	if (!PG_ARGISNULL(0))
+	{
+		topnTrans = (TopnAggState *) PG_GETARG_POINTER(0);
+		PruneTopnAggStateToCapacity(topnTrans);
+		sketch = MaterializeAggStateToTopnSketch(topnTrans);
+	}
+	else
+	{
+		sketch = CreateEmptyTopnSketch(0);
+	}
+
+	if (CompactSketches)
+	{
+		sketch = EncodeCompactTopnSketch(sketch);
+	}
+
+	PG_RETURN_TOPN_SKETCH(sketch);
+}
+
+
+/*
+ * topn_sketch_moving_pack is the final function of topn_sketch_agg when it is
+ * used as a moving aggregate. Like topn_moving_pack, it leaves the state as it
+ * is.
+ */
+Datum
+topn_sketch_moving_pack(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggctx;
+	TopnAggState *topnCopy = NULL;
+
+	/* We must be called as a transition routine or we fail. */
+	if (!AggCheckCallContext(fcinfo, &aggctx))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_EXCEPTION),
+				 errmsg("topn_sketch_moving_pack outside aggregate context")));
+	}
+
+	if (PG_ARGISNULL(0))
+	{
+		PG_RETURN_TOPN_SKETCH(CreateEmptyTopnSketch(0));
+	}
+
+	topnCopy = CopyMostFrequentCounters((TopnAggState *) PG_GETARG_POINTER(0));
+
+	PG_RETURN_TOPN_SKETCH(MaterializeAggStateToTopnSketch(topnCopy));
+}
+
+
+/*
+ * topn_sketch_empty returns an empty topn value which keeps the given number of
+ * counters, regardless of the topn.number_of_counters setting of the sessions
+ * that add to it.
+ */
+Datum
+topn_sketch_empty(PG_FUNCTION_ARGS)
+{
+	int32 capacity = GetTopnCapacity(PG_GETARG_INT32(0));
+
+	PG_RETURN_TOPN_SKETCH(CreateEmptyTopnSketch(capacity));
+}
+
+
+/*
+ * topn_stats returns the counters of the current backend as a single record,
+ * which shows how often the counters are pruned and merged and how much jsonb
+ * is decoded and encoded.
+ */
+Datum
+topn_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupleDescriptor = NULL;
+	Datum values[TOPN_STATISTICS_COUNT];
+	bool isNulls[TOPN_STATISTICS_COUNT];
+	HeapTuple statsTuple = NULL;
+
+	if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("function returning record called in context "
+						"that cannot accept type record")));
+	}
+
+	memset(isNulls, false, sizeof(isNulls));
+
+	values[0] = Int64GetDatum(TopnStats.pruneCount);
+	values[1] = Int64GetDatum(TopnStats.evictedItemCount);
+	values[2] = Int64GetDatum(TopnStats.mergedItemCount);
+	values[3] = Int64GetDatum(TopnStats.jsonbDecodeCount);
+	values[4] = Int64GetDatum(TopnStats.jsonbDecodedBytes);
+	values[5] = Int64GetDatum(TopnStats.jsonbEncodeCount);
+	values[6] = Int64GetDatum(TopnStats.jsonbEncodedBytes);
+	values[7] = Int64GetDatum((int64) TopnStats.peakStateSize);
+
+	statsTuple = heap_form_tuple(BlessTupleDesc(tupleDescriptor), values, isNulls);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(statsTuple));
+}
+
+
+/*
+ * topn_stats_reset sets the counters of the current backend back to zero.
+ */
+Datum
+topn_stats_reset(PG_FUNCTION_ARGS)
+{
+	memset(&TopnStats, 0, sizeof(TopnStats));
+
+	PG_RETURN_VOID();
+}
+
+
+#if PG_VERSION_NUM >= 180000
+
+/*
+ * topn_sketch_support is the planner support function of the functions which
+ * change a topn value. It lets PL/pgSQL pass the value of a variable as a
+ * read-write argument in s := topn_sketch_add(s, ...), so that the expanded
+ * sketch in the variable is changed in place.
+ */
+Datum
+topn_sketch_support(PG_FUNCTION_ARGS)
+{
+	Node *rawRequest = (Node *) PG_GETARG_POINTER(0);
+	Node *result = NULL;
+
+	if (IsA(rawRequest, SupportRequestModifyInPlace))
+	{
+		SupportRequestModifyInPlace *request = (SupportRequestModifyInPlace *) rawRequest;
+		Param *sketchParam = (Param *) linitial(request->args);
+
+		if (sketchParam != NULL && IsA(sketchParam, Param) &&
+			sketchParam->paramkind == PARAM_EXTERN &&
+			sketchParam->paramid == request->paramid)
+		{
+			result = (Node *) sketchParam;
+		}
+	}
+
+	PG_RETURN_POINTER(result);
+}
+
+#endif
+
+
+/*
+ * topn_compact trims the topn value to its most frequent capacity counters and
+ * returns it in the compact encoding, which is meant for storing the counters
+ * in roll-up tables. The returned value keeps the capacity.
+ */
+Datum
+topn_compact(PG_FUNCTION_ARGS)
+{
+	TopnSketch *sketch = PG_GETARG_TOPN_SKETCH(0);
+	int32 capacity = GetTopnCapacity(PG_GETARG_INT32(1));
+	TopnAggState *topn = CreateTopnAggState();
+
+	/* the counters are only pruned once all of them are merged */
+	topn->capacity = Max(capacity, sketch->itemCount);
+	MergeTopnSketchIntoTopnAggState(sketch, topn);
+
+	PG_RETURN_TOPN_SKETCH(CompactTopnAggState(topn, capacity));
+}
+
+
+/*
+ * jsonb_topn_compact is the topn_compact function for the jsonb counters. It
+ * returns a topn value, since jsonb has no more compact form.
+ */
+Datum
+jsonb_topn_compact(PG_FUNCTION_ARGS)
+{
+	Jsonb *jsonb = PG_GETARG_JSONB(0);
+	int32 capacity = GetTopnCapacity(PG_GETARG_INT32(1));
+	TopnAggState *topn = CreateTopnAggState();
+
+	/* the counters are only pruned once all of them are merged */
+	topn->capacity = Max(capacity, (int32) JB_ROOT_COUNT(jsonb));
+	MergeJsonbIntoTopnAggState(jsonb, topn);
+
+	PG_RETURN_TOPN_SKETCH(CompactTopnAggState(topn, capacity));
+}
+
+
+/*
+ * topn_frequency returns the frequency of the given item in the jsonb counters,
+ * or 0 if the item has no counter. The keys of a jsonb object are sorted, so the
+ * item is found by a binary search without decoding the other counters.
+ */
+Datum
+topn_frequency(PG_FUNCTION_ARGS)
+{
+	Jsonb *jsonb = PG_GETARG_JSONB(0);
+	text *itemText = PG_GETARG_TEXT_PP(1);
+	JsonbValue keyJsonbValue;
+	JsonbValue *frequencyJsonbValue = NULL;
+
+	keyJsonbValue.type = jbvString;
+	keyJsonbValue.val.string.val = VARDATA_ANY(itemText);
+	keyJsonbValue.val.string.len = TopnKeyLength(VARDATA_ANY(itemText),
+												 VARSIZE_ANY_EXHDR(itemText));
+
+	frequencyJsonbValue = findJsonbValueFromContainer(&jsonb->root, JB_FOBJECT,
+													  &keyJsonbValue);
+	if (frequencyJsonbValue == NULL || frequencyJsonbValue->type != jbvNumeric)
+	{
+		PG_RETURN_INT64(0);
+	}
+
+	PG_RETURN_INT64(JsonbNumericGetFrequency(frequencyJsonbValue->val.numeric));
+}
+
+
+/*
+ * topn_sketch_frequency is topn_frequency for the topn type. The item may be
+ * text, bigint or uuid, and it is looked up in the sorted keys of the sketch.
+ */
+Datum
+topn_sketch_frequency(PG_FUNCTION_ARGS)
+{
+	TopnSketchItem foundItem;
+	Frequency evictedTotal = 0;
+
+	if (!LookupTopnSketchItem(fcinfo, &foundItem, &evictedTotal))
+	{
+		PG_RETURN_INT64(0);
+	}
+
+	PG_RETURN_INT64(foundItem.frequency);
+}
+
+
+/*
+ * topn_frequency_with_error returns the bounds of the frequency of the given
+ * item in the topn value. The upper bound of an item without a counter is the
+ * evicted total of the sketch.
+ */
+Datum
+topn_frequency_with_error(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupleDescriptor = NULL;
+	TopnSketchItem foundItem;
+	Frequency evictedTotal = 0;
+	Datum values[2];
+	bool isNulls[2];
+	HeapTuple boundsTuple = NULL;
+
+	if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("function returning record called in context "
+						"that cannot accept type record")));
+	}
+
+	memset(isNulls, false, sizeof(isNulls));
+
+	if (LookupTopnSketchItem(fcinfo, &foundItem, &evictedTotal))
+	{
+		values[0] = Int64GetDatum(foundItem.frequency);
+		values[1] = Int64GetDatum(AddFrequencies(foundItem.frequency, foundItem.error));
+	}
+	else
+	{
+		values[0] = Int64GetDatum(0);
+		values[1] = Int64GetDatum(evictedTotal);
+	}
+
+	boundsTuple = heap_form_tuple(BlessTupleDesc(tupleDescriptor), values, isNulls);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(boundsTuple));
+}
+
+
+/*
+ * CompactTopnAggState prunes the TopnAggState to the given capacity and returns
+ * its counters as a sketch in the compact encoding.
+ */
+static TopnSketch *
+CompactTopnAggState(TopnAggState *topn, int32 capacity)
+{
+	topn->capacity = capacity;
+	PruneTopnAggStateToCapacity(topn);
+
+	return EncodeCompactTopnSketch(MaterializeAggStateToTopnSketch(topn));
+}
+
+
+
+/*
+ * FrequencyArrayFromJsonb function creates and returns a FrequencyItem array
+ * from a given JSONB container. The array has an item for every element of
+ * the container, and the number of the valid ones at its start is set in
+ * itemCount.
+ */
+static FrequentTopnItem *
+FrequencyArrayFromJsonb(JsonbContainer *container, int *itemCount)
+{
+	Size topnArraySize = 0;
+	FrequentTopnItem *topnItemArray = NULL;
+	char *keyData = NULL;
+	uint32 keyLength = 0;
+	int jsonbElementCount = 0;
+	int topnIndex = 0;
+	JsonbIteratorToken jsonbIteratorToken;
+	JsonbValue itemJsonbValue;
+	JsonbIterator *iterator = NULL;
+	Frequency frequencyValue = 0;
+
+	jsonbElementCount = JsonContainerSize(container);
+	topnArraySize = sizeof(FrequentTopnItem) * jsonbElementCount;
+	topnItemArray = (FrequentTopnItem *) palloc0(topnArraySize);
+
+	iterator = JsonbIteratorInit(container);
+	while ((jsonbIteratorToken = JsonbIteratorNext(&iterator, &itemJsonbValue, false)) !=
+		   WJB_DONE)
+	{
+		if (jsonbIteratorToken == WJB_KEY && itemJsonbValue.type == jbvString)
+		{
+			/* json rules guarantee this is a string */
+			keyData = itemJsonbValue.val.string.val;
+			keyLength = itemJsonbValue.val.string.len;
+
+			if (keyLength > MAX_KEYSIZE)
+			{
+				ereport(ERROR,
+						(errcode(ERRCODE_DATA_EXCEPTION),
+						 errmsg("this jsonb object includes a key which is longer than "
+								"allowed topn key size (256 bytes)")));
+			}
+
+			jsonbIteratorToken = JsonbIteratorNext(&iterator, &itemJsonbValue, false);
+			if (jsonbIteratorToken == WJB_VALUE && itemJsonbValue.type == jbvNumeric)
+			{
+				frequencyValue = JsonbNumericGetFrequency(itemJsonbValue.val.numeric);
+				InitTopnItemKey(&topnItemArray[topnIndex].key, TOPN_KEY_TEXT, keyData,
+								keyLength);
+				topnItemArray[topnIndex].frequency = frequencyValue;
+
+				topnIndex++;
+			}
+		}
+	}
+
+	*itemCount = topnIndex;
+
+	return topnItemArray;
+}
+
+
+/*
+ * DecodeJsonb decodes the counters of the jsonb sketch in the current memory
+ * context. The long keys of the counters point into the given jsonb.
+ */
+static void
+DecodeJsonb(TopnDecodedJsonb *decodedJsonb, Jsonb *jsonb)
+{
+	TopnStats.jsonbDecodeCount++;
+	TopnStats.jsonbDecodedBytes += VARSIZE(jsonb);
+
+	decodedJsonb->itemArray = FrequencyArrayFromJsonb(&jsonb->root,
+													  &decodedJsonb->itemCount);
+	decodedJsonb->elementCount = JsonContainerSize(&jsonb->root);
+	decodedJsonb->jsonb = jsonb;
+}
+
+
+/*
+ * GetCachedDecodedJsonb returns the counters of the given jsonb argument of the
+ * call from the jsonb cache of its call site. If neither entry of the cache
+ * holds the same jsonb, the jsonb is copied and decoded into the entry of the
+ * argument.
+ * The returned entry is valid until the next call of the same call site.
+ */
+static TopnDecodedJsonb *
+GetCachedDecodedJsonb(FunctionCallInfo fcinfo, int argumentIndex, Jsonb *jsonb)
+{
+	TopnJsonbCache *jsonbCache = (TopnJsonbCache *) fcinfo->flinfo->fn_extra;
+	MemoryContext oldContext = NULL;
+	TopnDecodedJsonb *decodedJsonb = NULL;
+	Size jsonbSize = VARSIZE(jsonb);
+	Jsonb *jsonbCopy = NULL;
+	int entryIndex = 0;
+
+	if (jsonbCache == NULL)
+	{
+		jsonbCache = MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt,
+											sizeof(TopnJsonbCache));
+		fcinfo->flinfo->fn_extra = jsonbCache;
+	}
+
+	for (entryIndex = 0; entryIndex < TOPN_JSONB_CACHE_SIZE; entryIndex++)
+	{
+		decodedJsonb = &jsonbCache->entries[entryIndex];
+
+		if (decodedJsonb->jsonb != NULL &&
+			VARSIZE(decodedJsonb->jsonb) == jsonbSize &&
+			memcmp(decodedJsonb->jsonb, jsonb, jsonbSize) == 0)
+		{
+			return decodedJsonb;
+		}
+	}
+
+	/* the entry is emptied first, so that an error leaves no half decoded entry */
+	decodedJsonb = &jsonbCache->entries[argumentIndex];
+	if (decodedJsonb->jsonb != NULL)
+	{
+		pfree(decodedJsonb->jsonb);
+		pfree(decodedJsonb->itemArray);
+		memset(decodedJsonb, 0, sizeof(TopnDecodedJsonb));
+	}
+
+	oldContext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+
+	jsonbCopy = (Jsonb *) palloc(jsonbSize);
+	memcpy(jsonbCopy, jsonb, jsonbSize);
+	DecodeJsonb(decodedJsonb, jsonbCopy);
+
+	MemoryContextSwitchTo(oldContext);
+
+	return decodedJsonb;
+}
+
+
+/*
+ * MergeDecodedJsonbIntoTopnAggState is MergeJsonbIntoTopnAggState for a jsonb
+ * which is already decoded. The hashes of the keys are reused, and the counters
+ * are merged and pruned in the same order as MergeJsonbIntoTopnAggState does.
+ */
+static void
+MergeDecodedJsonbIntoTopnAggState(TopnDecodedJsonb *decodedJsonb, TopnAggState *topn)
+{
+	int itemIndex = 0;
+
+	PrepareTopnAggStateKeyType(topn, TOPN_KEY_TEXT);
+
+	for (itemIndex = 0; itemIndex < decodedJsonb->itemCount; itemIndex++)
+	{
+		FrequentTopnItem *item = &decodedJsonb->itemArray[itemIndex];
+		int sizeOfHashTable = 0;
+		int remainingElements = 0;
+		int itemLimit = 0;
+
+		MergeItemKeyIntoTopnAggState(topn, &item->key, item->frequency, 0, 0);
+		TopnStats.mergedItemCount++;
+
+		sizeOfHashTable = TopnAggStateItemCount(topn);
+		remainingElements = sizeOfHashTable / 2;
+		itemLimit = TopnAggStateItemLimit(topn);
+		PruneHashTable(topn, itemLimit, remainingElements);
+	}
+}
+
+
+/*
+ * Creates an empty TopnAggState struct in the current memory context. The keys
+ * which do not fit into the counters are later stored in the same context.
+ * The counter table itself is only created when the first counter is added, so that the
+ * groups which never see an item stay small.
+ */
+static TopnAggState *
+CreateTopnAggState(void)
+{
+	TopnAggState *topn = NULL;
+
+	topn = (TopnAggState *) palloc0(sizeof(TopnAggState));
+	topn->context = CurrentMemoryContext;
+	topn->keyType = TOPN_KEY_TEXT;
+	topn->unionFactor = UnionFactor;
+
+	return topn;
+}
+
+
+/*
+ * CreateTopnHashTable creates the counter table of a TopnAggState in the
+ * current memory context with room for the given number of counters. The table
+ * usually starts small and grows as the counters are added, so that a state
+ * with a few distinct items does not pay for topn.number_of_counters slots up
+ * front. This matters when a hash aggregate keeps many groups.
+ */
+static TopnCounterTable *
+CreateTopnHashTable(long initialSize)
+{
+	TopnCounterTable *table = (TopnCounterTable *) palloc0(sizeof(TopnCounterTable));
+	uint32 slotCount = TOPN_TABLE_GROUP_SIZE;
+
+	table->context = CurrentMemoryContext;
+
+	/* the table is grown when it is 7/8 full */
+	while (slotCount / 8 * 7 < initialSize)
+	{
+		slotCount *= 2;
+	}
+
+	ResizeTopnCounterTable(table, slotCount);
+
+	return table;
+}
+
+
+/*
+ * MergeJsonbIntoTopnAggState extracts the topn object from a given Jsonb.
+ */
+static void
+MergeJsonbIntoTopnAggState(Jsonb *jsonb, TopnAggState *topn)
+{
+	JsonbContainer *container = &jsonb->root;
+	JsonbIterator *iterator = JsonbIteratorInit(container);
+	JsonbIteratorToken jsonbIteratorToken;
+	JsonbValue itemJsonbValue;
+	char *keyData = NULL;
+	uint32 keyLength = 0;
+	Frequency frequencyValue = 0;
+
+	TopnStats.jsonbDecodeCount++;
+	TopnStats.jsonbDecodedBytes += VARSIZE(jsonb);
+
+	PrepareTopnAggStateKeyType(topn, TOPN_KEY_TEXT);
+
+	while ((jsonbIteratorToken = JsonbIteratorNext(&iterator, &itemJsonbValue, false)) !=
+		   WJB_DONE)
+	{
+		if (jsonbIteratorToken == WJB_KEY && itemJsonbValue.type == jbvString)
+		{
+			/* json rules guarantee this is a string */
+			keyData = itemJsonbValue.val.string.val;
+			keyLength = itemJsonbValue.val.string.len;
+			if (keyLength > MAX_KEYSIZE)
+			{
+				ereport(ERROR,
+						(errcode(ERRCODE_DATA_EXCEPTION),
+						 errmsg("this jsonb object includes a key which is longer than "
+								"allowed topn key size (256 bytes)")));
+			}
+
+			jsonbIteratorToken = JsonbIteratorNext(&iterator, &itemJsonbValue, false);
+			if (jsonbIteratorToken == WJB_VALUE && itemJsonbValue.type == jbvNumeric)
+			{
+				int sizeOfHashTable = 0;
+				int remainingElements = 0;
+				int itemLimit = 0;
+
+				frequencyValue = JsonbNumericGetFrequency(itemJsonbValue.val.numeric);
+				AddItemToTopnAggState(topn, keyData, keyLength, frequencyValue);
+				TopnStats.mergedItemCount++;
+
+				sizeOfHashTable = TopnAggStateItemCount(topn);
+				remainingElements = sizeOfHashTable / 2;
+				itemLimit = TopnAggStateItemLimit(topn);
+				PruneHashTable(topn, itemLimit, remainingElements);
+			}
+		}
+	}
+}
+
+
+/*
+ * JsonbNumericGetFrequency converts the numeric value of a jsonb counter into a
+ * frequency. numeric_int8 reads the digits of the numeric directly, so no
+ * string is built for the counter.
+ */
+static Frequency
+JsonbNumericGetFrequency(Numeric frequencyNumeric)
+{
+	return DatumGetInt64(DirectFunctionCall1(numeric_int8,
+											 NumericGetDatum(frequencyNumeric)));
+}
+
+
+/*
+ * Comparator function for TopnItemCandidate structs, which ranks the more
+ * frequent items first and breaks the ties by the order of the candidates.
+ */
+static int
+compareTopnItemCandidate(const void *candidate1, const void *candidate2)
+{
+	const TopnItemCandidate *topnCandidate1 = (const TopnItemCandidate *) candidate1;
+	const TopnItemCandidate *topnCandidate2 = (const TopnItemCandidate *) candidate2;
+	Frequency freq1 = topnCandidate1->item->frequency;
+	Frequency freq2 = topnCandidate2->item->frequency;
+
+	if (freq1 > freq2)
+	{
+		return -1;
+	}
+	else if (freq1 < freq2)
+	{
+		return 1;
+	}
+
+	return topnCandidate1->order - topnCandidate2->order;
+}
+
+
+/*
+ * Comparator function for pointers to FrequentTopnItem structs to sort them by
+ * their keys, which is the order the items are kept in a TopnSketch.
+ */
+static int
+compareFrequentTopnItemKey(const void *item1, const void *item2)
+{
+	FrequentTopnItem *topnItem1 = *((FrequentTopnItem **) item1);
+	FrequentTopnItem *topnItem2 = *((FrequentTopnItem **) item2);
+
+	return CompareTopnKeys(TopnItemKeyData(&topnItem1->key), topnItem1->key.length,
+						   TopnItemKeyData(&topnItem2->key), topnItem2->key.length);
+}
+
+
+/*
+ * Comparator function for pointers to TopnSketchItem structs to sort them by
+ * decreasing frequency. The ties are broken by the position of the items in
+ * the sketch, so that the order does not depend on the sort algorithm.
+ */
+static int
+compareTopnSketchItemFrequency(const void *item1, const void *item2)
+{
+	TopnSketchItem *sketchItem1 = *((TopnSketchItem **) item1);
+	TopnSketchItem *sketchItem2 = *((TopnSketchItem **) item2);
+
+	if (sketchItem1->frequency > sketchItem2->frequency)
+	{
+		return -1;
+	}
+	else if (sketchItem1->frequency < sketchItem2->frequency)
+	{
+		return 1;
+	}
+	else if (sketchItem1 < sketchItem2)
+	{
+		return -1;
+	}
+	else if (sketchItem1 > sketchItem2)
+	{
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * CreateTopnTupleDescriptor creates the blessed tuple descriptor of the
+ * (item, frequency) records returned by the topn() functions.
+ */
+static TupleDesc
+CreateTopnTupleDescriptor(void)
+{
+	TupleDesc tupleDescriptor =
+#if PG_VERSION_NUM < 120000
+		CreateTemplateTupleDesc(2, false);
+#else
+		CreateTemplateTupleDesc(2);
+#endif
+	TupleDescInitEntry(tupleDescriptor, (AttrNumber) 1, "item",
+					   TEXTOID, -1, 0);
+	TupleDescInitEntry(tupleDescriptor, (AttrNumber) 2, "frequency",
+					   INT8OID, -1, 0);
+
+	return BlessTupleDesc(tupleDescriptor);
+}
+
+
+/*
+ * topnGetTuple converts the FrequentTopnItem passed to it into the heap tuple
+ * of its topn key and value.
+ */
+static HeapTuple
+topnGetTuple(FrequentTopnItem *topnItem, TupleDesc tupleDescriptor)
+{
+	Datum values[2];
+	bool isNulls[2];
+
+	memset(values, 0, sizeof(values));
+	memset(isNulls, false, sizeof(isNulls));
+
+	values[0] = PointerGetDatum(cstring_to_text_with_len(TopnItemKeyData(&topnItem->key),
+														 topnItem->key.length));
+	values[1] = Int64GetDatum((Frequency) topnItem->frequency);
+
+	return heap_form_tuple(tupleDescriptor, values, isNulls);
+}
+
+
+/*
+ * InitTopnMaterializedResult sets up the ReturnSetInfo of the call to return
+ * the rows of a set returning function in a tuplestore. Unlike the value per
+ * call mode, this leaves the fn_extra of the call site to the function. From
+ * PostgreSQL 15 on, InitMaterializedSRF does the same.
+ */
+static void
+InitTopnMaterializedResult(FunctionCallInfo fcinfo)
+{
+#if PG_VERSION_NUM >= 150000
+	InitMaterializedSRF(fcinfo, 0);
+#else
+	ReturnSetInfo *resultInfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext oldContext = NULL;
+
+	if (resultInfo == NULL || !IsA(resultInfo, ReturnSetInfo))
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("set-valued function called in context that cannot "
+							   "accept a set")));
+	}
+
+	if (!(resultInfo->allowedModes & SFRM_Materialize))
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("materialize mode required, but it is not allowed "
+							   "in this context")));
+	}
+
+	oldContext = MemoryContextSwitchTo(resultInfo->econtext->ecxt_per_query_memory);
+
+	resultInfo->returnMode = SFRM_Materialize;
+	resultInfo->setDesc = CreateTopnTupleDescriptor();
+	resultInfo->setResult =
+		tuplestore_begin_heap(resultInfo->allowedModes & SFRM_Materialize_Random,
+							  false, work_mem);
+
+	MemoryContextSwitchTo(oldContext);
+#endif
+}
+
+
+/*
+ * TopnSketchItemGetDatum returns the key of the sketch item as a datum of the
+ * item type of the topn() call. The keys which are already kept in that type
+ * are returned directly, and the others are converted through text.
+ */
+static Datum
+TopnSketchItemGetDatum(TopnSketchCallContext *sketchCallContext, TopnSketchItem *item)
+{
+	TopnSketch *sketch = sketchCallContext->sketch;
+	uint8 keyType = TopnSketchKeyType(sketch);
+	Oid itemType = sketchCallContext->itemType;
+	char *keyData = TopnSketchKeyData(sketch) + item->keyOffset;
+	char *keyString = NULL;
+
+	if (keyType == TOPN_KEY_TEXT && itemType == TEXTOID)
+	{
+		return PointerGetDatum(cstring_to_text_with_len(keyData, item->keyLength));
+	}
+	else if (keyType == TOPN_KEY_INT8 && itemType == INT8OID)
+	{
+		return Int64GetDatum(DecodeInt8Key(keyData));
+	}
+	else if (keyType == TOPN_KEY_UUID && itemType == UUIDOID)
+	{
+		pg_uuid_t *uuid = (pg_uuid_t *) palloc(sizeof(pg_uuid_t));
+
+		memcpy(uuid->data, keyData, UUID_LEN);
+		return UUIDPGetDatum(uuid);
+	}
+
+	keyString = TopnKeyToCString(keyType, keyData, item->keyLength);
+
+	return OidInputFunctionCall(sketchCallContext->itemInputFunction, keyString,
+								sketchCallContext->itemInputParam, -1);
+}
+
+
+/*
+ * PruneHashTable removes some items from the HashTable to decrease its size. If
+ * the HashTable has more than itemLimit items, it keeps the most frequent
+ * numberOfRemainingElements items and removes the others. The items to keep are
+ * found by a linear time selection, since their order does not matter here. The
+ * evicted total is raised to the highest upper bound of the removed items, so
+ * that it still bounds the frequency of any item without a counter.
+ */
+static void
+PruneHashTable(TopnAggState *topn, int itemLimit, int numberOfRemainingElements)
+{
+	TopnCounterTable *hashTable = NULL;
+	TopnItemCandidate *candidateArray = NULL;
+	int candidateIndex = 0;
+	int hashTableSize = TopnAggStateItemCount(topn);
+
+	if (hashTableSize <= itemLimit)
+	{
+		return;
+	}
+
+	hashTable = topnHashtable(topn);
+
+	UpdatePeakStateSize(topn);
+	TopnStats.pruneCount++;
+	TopnStats.evictedItemCount += hashTableSize - numberOfRemainingElements;
+
+	candidateArray = SelectTopnItemCandidates(topn, numberOfRemainingElements);
+
+	for (candidateIndex = numberOfRemainingElements; candidateIndex < hashTableSize;
+		 candidateIndex++)
+	{
+		FrequentTopnItem *topnItem = candidateArray[candidateIndex].item;
+		Frequency upperBound = AddFrequencies(topnItem->frequency,
+											  TopnItemError(topn, topnItem));
+
+		topn->evictedTotal = Max(topn->evictedTotal, upperBound);
+
+		if (!TopnItemKeyIsInline(&topnItem->key))
+		{
+			topn->liveKeySize -= topnItem->key.length;
+		}
+
+		TopnCounterTableRemove(hashTable, topnItem);
+	}
+
+	pfree(candidateArray);
+
+	CompactTopnKeyArena(topn);
+}
+
+
+/*
+ * PruneTopnAggStateToCapacity prunes the TopnAggState down to its capacity.
+ */
+static void
+PruneTopnAggStateToCapacity(TopnAggState *topn)
+{
+	int32 capacity = TopnAggStateCapacity(topn);
+
+	PruneHashTable(topn, capacity, capacity);
+}
+
+
+/*
+ * SelectTopnItemCandidates returns the counters of the TopnAggState as an array
+ * of candidates whose first selectCount entries are the most frequent counters.
+ * The ties are broken by the order of the counters in the counter table, so the
+ * same counters are selected for the same table.
+ */
+static TopnItemCandidate *
+SelectTopnItemCandidates(TopnAggState *topn, int selectCount)
+{
+	int itemCount = TopnAggStateItemCount(topn);
+	TopnItemCandidate *candidateArray = NULL;
+	TopnCounterTableIterator iterator;
+	FrequentTopnItem *currentTask = NULL;
+	int candidateIndex = 0;
+
+	candidateArray = (TopnItemCandidate *) palloc(sizeof(TopnItemCandidate) *
+												   Max(itemCount, 1));
+
+	TopnCounterTableSeqInit(&iterator, topnHashtable(topn));
+	while ((currentTask = TopnCounterTableSeqNext(&iterator)) != NULL)
+	{
+		candidateArray[candidateIndex].item = currentTask;
+		candidateArray[candidateIndex].order = candidateIndex;
+		candidateIndex++;
+	}
+
+	SelectMostFrequentElements(candidateArray, itemCount, sizeof(TopnItemCandidate),
+							   selectCount, compareTopnItemCandidate);
+
+	return candidateArray;
+}
+
+
+/*
+ * CopyMostFrequentCounters returns a new TopnAggState with the counters that
+ * PruneTopnAggStateToCapacity would keep, and the evicted total it would leave,
+ * without changing the given state. The counters are copied directly, so the
+ * copy is neither counted as a merge nor as a prune in topn_stats().
+ */
+static TopnAggState *
+CopyMostFrequentCounters(TopnAggState *topn)
+{
+	TopnAggState *topnCopy = CreateTopnAggState();
+	TopnItemCandidate *candidateArray = NULL;
+	Frequency evictedTotal = topn->evictedTotal;
+	int itemCount = TopnAggStateItemCount(topn);
+	int copyCount = Min(itemCount, TopnAggStateCapacity(topn));
+	int candidateIndex = 0;
+
+	topnCopy->keyType = topn->keyType;
+	topnCopy->capacity = topn->capacity;
+	topnCopy->unionFactor = topn->unionFactor;
+
+	if (itemCount == 0)
+	{
+		topnCopy->evictedTotal = evictedTotal;
+		return topnCopy;
+	}
+
+	candidateArray = SelectTopnItemCandidates(topn, copyCount);
+	topnCopy->hashTable = CreateTopnHashTable(copyCount);
+
+	for (candidateIndex = 0; candidateIndex < itemCount; candidateIndex++)
+	{
+		FrequentTopnItem *topnItem = candidateArray[candidateIndex].item;
+		Frequency error = TopnItemError(topn, topnItem);
+		TopnItemKey itemKey;
+
+		if (candidateIndex >= copyCount)
+		{
+			evictedTotal = Max(evictedTotal, AddFrequencies(topnItem->frequency, error));
+			continue;
+		}
+
+		InitHashedTopnItemKey(&itemKey, TopnItemKeyData(&topnItem->key),
+							  topnItem->key.length, topnItem->key.hash);
+		MergeItemKeyIntoTopnAggState(topnCopy, &itemKey, topnItem->frequency, error, 0);
+	}
+
+	/* the errors of the copied counters do not include the evicted total */
+	topnCopy->evictedTotal = evictedTotal;
+
+	pfree(candidateArray);
+
+	return topnCopy;
+}
+
+
+/*
+ * UpdatePeakStateSize estimates the memory used by the counters of the
+ * TopnAggState and records it if it is the largest state seen so far.
+ */
+static void
+UpdatePeakStateSize(TopnAggState *topn)
+{
+	long itemCount = TopnAggStateItemCount(topn);
+	Size stateSize = sizeof(TopnAggState) +
+					 TopnCounterTableSize(itemCount) +
+					 topn->allocatedKeySize;
+
+	if (topn->frontCache != NULL)
+	{
+		stateSize += TOPN_FRONT_CACHE_SIZE * sizeof(TopnFrontCacheEntry);
+	}
+
+	TopnStats.peakStateSize = Max(TopnStats.peakStateSize, stateSize);
+}
+
+
+/*
+ * TopnAggStateCapacity returns the number of counters the TopnAggState keeps
+ * after it is packed, which is topn.number_of_counters if the state has no
+ * capacity of its own.
+ */
+static int32
+TopnAggStateCapacity(TopnAggState *topn)
+{
+	if (topn->capacity > 0)
+	{
+		return topn->capacity;
+	}
+
+	return NumberOfCounters;
+}
+
+
+/*
+ * TopnAggStateItemLimit returns the number of counters after which the
+ * TopnAggState is pruned while items are aggregated into it.
+ */
+static int32
+TopnAggStateItemLimit(TopnAggState *topn)
+{
+	int64 itemLimit = (int64) TopnAggStateCapacity(topn) * Max(topn->unionFactor, 1);
+
+	return (int32) Min(itemLimit, PG_INT32_MAX);
+}
+
+
+/*
+ * TopnSketchCapacity returns the number of counters the sketch keeps, which is
+ * topn.number_of_counters if the sketch has no capacity of its own.
+ */
+static int32
+TopnSketchCapacity(TopnSketch *sketch)
+{
+	if (sketch->capacity > 0)
+	{
+		return sketch->capacity;
+	}
+
+	return NumberOfCounters;
+}
+
+
+/*
+ * MergeTopnCapacity raises the capacity and the union factor of the
+ * TopnAggState to the ones of a merged sketch or state, so that the union keeps
+ * as many counters as the largest of its inputs.
+ */
+static void
+MergeTopnCapacity(TopnAggState *topn, int32 capacity, int32 unionFactor)
+{
+	topn->capacity = Max(topn->capacity, capacity);
+	topn->unionFactor = Max(topn->unionFactor, unionFactor);
+}
+
+
+/*
+ * GetTopnCapacity checks the capacity given to an aggregate or a constructor.
+ */
+static int32
+GetTopnCapacity(int32 capacity)
+{
+	if (capacity < 1 || capacity > JSONB_MAX_PAIRS)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("the capacity of a topn counter must be between 1 and %d",
+						(int) JSONB_MAX_PAIRS)));
+	}
+
+	return capacity;
+}
+
+
+/*
+ * SelectMostFrequentElements reorders the elements of the array so that the
+ * first selectCount of them are the ones that come first in the order of the
+ * given qsort comparator. The comparators used here break all ties, so the same
+ * elements are selected as with a full sort of the array. It is a quickselect,
+ * which runs in linear time on average.
+ */
+static void
+SelectMostFrequentElements(void *elementArray, int elementCount, Size elementSize,
+						   int selectCount, int (*compare)(const void *, const void *))
+{
+	char *elements = (char *) elementArray;
+	int left = 0;
+	int right = elementCount - 1;
+
+	if (selectCount <= 0 || selectCount >= elementCount)
+	{
+		return;
+	}
+
+	while (left < right)
+	{
+		int middle = left + (right - left) / 2;
+		char *pivot = elements + right * elementSize;
+		int storeIndex = left;
+		int elementIndex = 0;
+
+		/* move the pivot to the end, and the higher ranked elements before it */
+		SwapElements(elements + middle * elementSize, pivot, elementSize);
+
+		for (elementIndex = left; elementIndex < right; elementIndex++)
+		{
+			if (compare(elements + elementIndex * elementSize, pivot) < 0)
+			{
+				SwapElements(elements + elementIndex * elementSize,
+							 elements + storeIndex * elementSize, elementSize);
+				storeIndex++;
+			}
+		}
+
+		SwapElements(elements + storeIndex * elementSize, pivot, elementSize);
+
+		if (storeIndex == selectCount)
+		{
+			return;
+		}
+		else if (storeIndex < selectCount)
+		{
+			left = storeIndex + 1;
+		}
+		else
+		{
+			right = storeIndex - 1;
+		}
+	}
+}
+
+
+/*
+ * SwapElements swaps the contents of two array elements of the given size.
+ */
+static void
+SwapElements(char *element1, char *element2, Size elementSize)
+{
+	Size byteIndex = 0;
+
+	for (byteIndex = 0; byteIndex < elementSize; byteIndex++)
+	{
+		char swapByte = element1[byteIndex];
+
+		element1[byteIndex] = element2[byteIndex];
+		element2[byteIndex] = swapByte;
+	}
+}
+
+
+/*
+ * MaterializeAggStateToJsonb extracts the jsonb object from a given counter table. The
+ * pairs are pushed into the jsonb directly, so the keys and the frequencies do
+ * not need to be printed into json text and parsed again. The typed keys are
+ * converted into text first.
+ */
+static Jsonb *
+MaterializeAggStateToJsonb(TopnAggState *topn)
+{
+	JsonbParseState *parseState = NULL;
+	JsonbValue *result = NULL;
+	Jsonb *jsonb = NULL;
+	TopnCounterTableIterator iterator;
+	FrequentTopnItem *currentTask = NULL;
+
+	UpdatePeakStateSize(topn);
+
+	pushJsonbValue(&parseState, WJB_BEGIN_OBJECT, NULL);
+
+	TopnCounterTableSeqInit(&iterator, topnHashtable(topn));
+	while ((currentTask = TopnCounterTableSeqNext(&iterator)) != NULL)
+	{
+		JsonbValue keyJsonbValue;
+		JsonbValue frequencyJsonbValue;
+
+		keyJsonbValue.type = jbvString;
+		if (topn->keyType == TOPN_KEY_TEXT)
+		{
+			keyJsonbValue.val.string.val = (char *) TopnItemKeyData(&currentTask->key);
+			keyJsonbValue.val.string.len = currentTask->key.length;
+		}
+		else
+		{
+			keyJsonbValue.val.string.val =
+				TopnKeyToCString(topn->keyType, TopnItemKeyData(&currentTask->key),
+								 currentTask->key.length);
+			keyJsonbValue.val.string.len =
+				checkStringLen(strlen(keyJsonbValue.val.string.val));
+		}
+
+		frequencyJsonbValue.type = jbvNumeric;
+		frequencyJsonbValue.val.numeric =
+			DatumGetNumeric(DirectFunctionCall1(int8_numeric,
+												Int64GetDatum(currentTask->frequency)));
+
+		pushJsonbValue(&parseState, WJB_KEY, &keyJsonbValue);
+		pushJsonbValue(&parseState, WJB_VALUE, &frequencyJsonbValue);
+	}
+
+	result = pushJsonbValue(&parseState, WJB_END_OBJECT, NULL);
+	jsonb = JsonbValueToJsonb(result);
+
+	TopnStats.jsonbEncodeCount++;
+	TopnStats.jsonbEncodedBytes += VARSIZE(jsonb);
+
+	return jsonb;
+}
+
+
+/*
+ * CreateEmptyJsonb returns an empty jsonb object.
+ */
+static Jsonb *
+CreateEmptyJsonb(void)
+{
+	JsonbParseState *parseState = NULL;
+	JsonbValue *result = NULL;
+
+	pushJsonbValue(&parseState, WJB_BEGIN_OBJECT, NULL);
+	result = pushJsonbValue(&parseState, WJB_END_OBJECT, NULL);
+
+	return JsonbValueToJsonb(result);
+}
+
+
+/*
+ * DatumGetTopnSketch detoasts the given topn datum and checks that its layout
+ * is the one this version of the extension knows.
+ */
+static TopnSketch *
+DatumGetTopnSketch(Datum datum)
+{
+	TopnSketch *sketch = (TopnSketch *) PG_DETOAST_DATUM(datum);
+
+	CheckTopnSketchVersion(sketch);
+
+	if (TopnSketchIsCompact(sketch))
+	{
+		sketch = DecodeCompactTopnSketch(sketch);
+	}
+
+	return sketch;
+}
+
+
+/*
+ * CheckTopnSketchVersion errors out if the layout or the key type of the sketch
+ * is not one this version of the extension knows.
+ */
+static void
+CheckTopnSketchVersion(TopnSketch *sketch)
+{
+	if (sketch->version != TOPN_SKETCH_VERSION)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("unsupported topn version number %d", sketch->version)));
+	}
+
+	if (TopnSketchKeyType(sketch) > TOPN_KEY_UUID)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("unsupported topn key type %d", TopnSketchKeyType(sketch))));
+	}
+}
+
+
+static const ExpandedObjectMethods ExpandedTopnSketchMethods =
+{
+	ExpandedTopnSketchFlatSize,
+	FlattenExpandedTopnSketch
+};
+
+
+/*
+ * CreateExpandedTopnSketch creates an expanded object without a sketch in a new
+ * memory context under the current memory context. The caller puts a sketch
+ * which is allocated in the memory context of the object into it.
+ */
+static ExpandedTopnSketch *
+CreateExpandedTopnSketch(void)
+{
+	MemoryContext objectContext = AllocSetContextCreate(CurrentMemoryContext,
+														"expanded topn",
+														ALLOCSET_SMALL_SIZES);
+	ExpandedTopnSketch *expandedSketch = NULL;
+
+	expandedSketch = (ExpandedTopnSketch *) MemoryContextAlloc(objectContext,
+															   sizeof(ExpandedTopnSketch));
+	EOH_init_header(&expandedSketch->header, &ExpandedTopnSketchMethods, objectContext);
+	expandedSketch->sketch = NULL;
+
+	return expandedSketch;
+}
+
+
+/*
+ * ExpandTopnSketch creates an expanded object with a copy of the sketch.
+ */
+static ExpandedTopnSketch *
+ExpandTopnSketch(TopnSketch *sketch)
+{
+	ExpandedTopnSketch *expandedSketch = CreateExpandedTopnSketch();
+
+	expandedSketch->sketch = (TopnSketch *) MemoryContextAlloc(expandedSketch->header.eoh_context,
+															   VARSIZE(sketch));
+	memcpy(expandedSketch->sketch, sketch, VARSIZE(sketch));
+
+	return expandedSketch;
+}
+
+
+/*
+ * DatumGetExpandedTopnSketch returns the expanded object of the datum, or NULL
+ * if the datum is a flat sketch.
+ */
+static ExpandedTopnSketch *
+DatumGetExpandedTopnSketch(Datum datum)
+{
+	ExpandedObjectHeader *header = NULL;
+
+	if (!VARATT_IS_EXTERNAL_EXPANDED(DatumGetPointer(datum)))
+	{
+		return NULL;
+	}
+
+	header = DatumGetEOHP(datum);
+	if (header->eoh_methods != &ExpandedTopnSketchMethods)
+	{
+		return NULL;
+	}
+
+	return (ExpandedTopnSketch *) header;
+}
+
+
+/*
+ * GetWritableTopnSketch returns an expanded sketch which the caller may change.
+ * A read-write expanded argument belongs to the function, so it is returned as
+ * it is. Otherwise, the sketch is copied into a new expanded object.
+ */
+static ExpandedTopnSketch *
+GetWritableTopnSketch(Datum datum)
+{
+	ExpandedTopnSketch *expandedSketch = DatumGetExpandedTopnSketch(datum);
+
+	if (expandedSketch == NULL)
+	{
+		return ExpandTopnSketch(DatumGetTopnSketch(datum));
+	}
+	else if (!VARATT_IS_EXTERNAL_EXPANDED_RW(DatumGetPointer(datum)))
+	{
+		return ExpandTopnSketch(expandedSketch->sketch);
+	}
+
+	return expandedSketch;
+}
+
+
+/*
+ * GetReadableTopnSketch is DatumGetTopnSketch which reads an expanded sketch
+ * without flattening it. The returned sketch must not be changed.
+ */
+static TopnSketch *
+GetReadableTopnSketch(Datum datum)
+{
+	ExpandedTopnSketch *expandedSketch = DatumGetExpandedTopnSketch(datum);
+
+	if (expandedSketch != NULL)
+	{
+		return expandedSketch->sketch;
+	}
+
+	return DatumGetTopnSketch(datum);
+}
+
+
+/*
+ * SetExpandedTopnSketch makes the given sketch the sketch of the expanded
+ * object. The functions which add to a sketch return the same sketch when they
+ * only changed it in place, and a new sketch otherwise, which is then copied
+ * into the memory context of the object.
+ */
+static void
+SetExpandedTopnSketch(ExpandedTopnSketch *expandedSketch, TopnSketch *sketch)
+{
+	TopnSketch *oldSketch = expandedSketch->sketch;
+
+	if (sketch == oldSketch)
+	{
+		return;
+	}
+
+	expandedSketch->sketch = (TopnSketch *) MemoryContextAlloc(expandedSketch->header.eoh_context,
+															   VARSIZE(sketch));
+	memcpy(expandedSketch->sketch, sketch, VARSIZE(sketch));
+
+	pfree(oldSketch);
+}
+
+
+/*
+ * ExpandedTopnSketchFlatSize returns the size of the flat form of an expanded
+ * sketch, which is the size of its sketch.
+ */
+static Size
+ExpandedTopnSketchFlatSize(ExpandedObjectHeader *header)
+{
+	ExpandedTopnSketch *expandedSketch = (ExpandedTopnSketch *) header;
+
+	return VARSIZE(expandedSketch->sketch);
+}
+
+
+/*
+ * FlattenExpandedTopnSketch copies the sketch of an expanded object into the
+ * given memory.
+ */
+static void
+FlattenExpandedTopnSketch(ExpandedObjectHeader *header, void *result, Size allocatedSize)
+{
+	ExpandedTopnSketch *expandedSketch = (ExpandedTopnSketch *) header;
+
+	Assert(allocatedSize == VARSIZE(expandedSketch->sketch));
+
+	memcpy(result, expandedSketch->sketch, allocatedSize);
+}
+
+
+/*
+ * EncodeCompactTopnSketch writes the items of the sketch in the compact
+ * encoding. Since the items are sorted by their keys, each key is written as
+ * the length of the prefix it shares with the previous key, the length of the
+ * rest of the key and its bytes. The frequency and the error follow as varints.
+ */
+static TopnSketch *
+EncodeCompactTopnSketch(TopnSketch *sketch)
+{
+	char *keyData = TopnSketchKeyData(sketch);
+	const char *previousKey = NULL;
+	uint32 previousKeyLength = 0;
+	TopnSketch *compactSketch = NULL;
+	Size keyDataSize = 0;
+	Size maximumSize = 0;
+	char *dataPtr = NULL;
+	int itemIndex = 0;
+
+	for (itemIndex = 0; itemIndex < sketch->itemCount; itemIndex++)
+	{
+		keyDataSize += sketch->items[itemIndex].keyLength;
+	}
+
+	maximumSize = TopnSketchHeaderSize +
+				  (Size) sketch->itemCount * 4 * TOPN_VARINT_MAX_SIZE + keyDataSize;
+	compactSketch = (TopnSketch *) palloc(maximumSize);
+	memcpy(compactSketch, sketch, TopnSketchHeaderSize);
+	compactSketch->flags |= TOPN_SKETCH_COMPACT;
+
+	dataPtr = TopnSketchCompactData(compactSketch);
+	for (itemIndex = 0; itemIndex < sketch->itemCount; itemIndex++)
+	{
+		TopnSketchItem *item = &sketch->items[itemIndex];
+		const char *key = keyData + item->keyOffset;
+		uint32 maximumPrefixLength = Min(previousKeyLength, item->keyLength);
+		uint32 prefixLength = 0;
+		uint32 suffixLength = 0;
+
+		while (prefixLength < maximumPrefixLength &&
+			   previousKey[prefixLength] == key[prefixLength])
+		{
+			prefixLength++;
+		}
+
+		suffixLength = item->keyLength - prefixLength;
+
+		dataPtr = WriteVarint(dataPtr, prefixLength);
+		dataPtr = WriteVarint(dataPtr, suffixLength);
+		memcpy(dataPtr, key + prefixLength, suffixLength);
+		dataPtr += suffixLength;
+		dataPtr = WriteVarint(dataPtr, (uint64) item->frequency);
+		dataPtr = WriteVarint(dataPtr, (uint64) item->error);
+
+		previousKey = key;
+		previousKeyLength = item->keyLength;
+	}
+
+	SET_VARSIZE(compactSketch, dataPtr - (char *) compactSketch);
+
+	return compactSketch;
+}
+
+
+/*
+ * DecodeCompactTopnSketch expands a sketch in the compact encoding into the
+ * usual layout. The stream is read twice: first to check it and to find the
+ * size of the key area, and then to fill the items and the keys.
+ */
+static TopnSketch *
+DecodeCompactTopnSketch(TopnSketch *compactSketch)
+{
+	const char *dataStart = TopnSketchCompactData(compactSketch);
+	const char *dataEnd = (char *) compactSketch + VARSIZE(compactSketch);
+	const char *dataPtr = NULL;
+	TopnSketch *sketch = NULL;
+	char *keyData = NULL;
+	uint32 keyTypeSize = TopnKeyTypeSize(TopnSketchKeyType(compactSketch));
+	uint64 previousKeyLength = 0;
+	uint32 previousKeyOffset = 0;
+	uint32 keyOffset = 0;
+	Size keyDataSize = 0;
+	Size sketchSize = 0;
+	int itemIndex = 0;
+
+	if (VARSIZE(compactSketch) < TopnSketchHeaderSize || compactSketch->itemCount < 0 ||
+		compactSketch->itemCount > dataEnd - dataStart)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("corrupted compact topn value")));
+	}
+
+	dataPtr = dataStart;
+	for (itemIndex = 0; itemIndex < compactSketch->itemCount; itemIndex++)
+	{
+		uint64 prefixLength = 0;
+		uint64 suffixLength = 0;
+		uint64 frequency = 0;
+		uint64 error = 0;
+
+		dataPtr = ReadVarint(dataPtr, dataEnd, &prefixLength);
+		dataPtr = ReadVarint(dataPtr, dataEnd, &suffixLength);
+		if (prefixLength > previousKeyLength || suffixLength > dataEnd - dataPtr)
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("corrupted compact topn value")));
+		}
+
+		dataPtr += suffixLength;
+		dataPtr = ReadVarint(dataPtr, dataEnd, &frequency);
+		dataPtr = ReadVarint(dataPtr, dataEnd, &error);
+		if (frequency > MAX_FREQUENCY || error > MAX_FREQUENCY)
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("corrupted compact topn value")));
+		}
+
+		/* the bigint and uuid keys are read back with their fixed size */
+		previousKeyLength = prefixLength + suffixLength;
+		if (previousKeyLength > MAX_KEYSIZE ||
+			(keyTypeSize != 0 && previousKeyLength != keyTypeSize))
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("corrupted compact topn value")));
+		}
+
+		keyDataSize += previousKeyLength;
+	}
+
+	if (dataPtr != dataEnd || keyDataSize > MaxAllocSize)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("corrupted compact topn value")));
+	}
+
+	sketchSize = TopnSketchHeaderSize +
+				 compactSketch->itemCount * sizeof(TopnSketchItem) + keyDataSize;
+	sketch = (TopnSketch *) palloc(sketchSize);
+	memcpy(sketch, compactSketch, TopnSketchHeaderSize);
+	SET_VARSIZE(sketch, sketchSize);
+	sketch->flags &= ~TOPN_SKETCH_COMPACT;
+
+	keyData = TopnSketchKeyData(sketch);
+	dataPtr = dataStart;
+	for (itemIndex = 0; itemIndex < sketch->itemCount; itemIndex++)
+	{
+		TopnSketchItem *item = &sketch->items[itemIndex];
+		uint64 prefixLength = 0;
+		uint64 suffixLength = 0;
+		uint64 frequency = 0;
+		uint64 error = 0;
+
+		dataPtr = ReadVarint(dataPtr, dataEnd, &prefixLength);
+		dataPtr = ReadVarint(dataPtr, dataEnd, &suffixLength);
+
+		memcpy(keyData + keyOffset, keyData + previousKeyOffset, prefixLength);
+		memcpy(keyData + keyOffset + prefixLength, dataPtr, suffixLength);
+		dataPtr += suffixLength;
+
+		dataPtr = ReadVarint(dataPtr, dataEnd, &frequency);
+		dataPtr = ReadVarint(dataPtr, dataEnd, &error);
+
+		item->frequency = (Frequency) frequency;
+		item->error = (Frequency) error;
+		item->keyOffset = keyOffset;
+		item->keyLength = (uint32) (prefixLength + suffixLength);
+
+		previousKeyOffset = keyOffset;
+		keyOffset += item->keyLength;
+	}
+
+	return sketch;
+}
+
+
+/*
+ * WriteVarint writes the value into the buffer seven bits at a time, starting
+ * from the lowest ones, and returns the position after it. The highest bit of
+ * each byte tells whether more bytes follow.
+ */
+static char *
+WriteVarint(char *buffer, uint64 value)
+{
+	while (value >= 0x80)
+	{
+		*buffer++ = (char) ((value & 0x7F) | 0x80);
+		value >>= 7;
+	}
+
+	*buffer++ = (char) value;
+
+	return buffer;
+}
+
+
+/*
+ * ReadVarint reads a value written by WriteVarint and returns the position
+ * after it. It errors out instead of reading past the end of the buffer.
+ */
+static const char *
+ReadVarint(const char *buffer, const char *bufferEnd, uint64 *value)
+{
+	uint64 result = 0;
+	int shift = 0;
+
+	while (true)
+	{
+		uint8 byte = 0;
+
+		if (buffer >= bufferEnd || shift > 63)
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("corrupted topn value")));
+		}
+
+		byte = (uint8) *buffer++;
+		result |= ((uint64) (byte & 0x7F)) << shift;
+
+		if ((byte & 0x80) == 0)
+		{
+			break;
+		}
+
+		shift += 7;
+	}
+
+	*value = result;
+
+	return buffer;
+}
+
+
+/*
+ * CreateEmptyTopnSketch creates a TopnSketch without any items. A capacity of
+ * 0 means that the sketch follows the topn.number_of_counters setting.
+ */
+static TopnSketch *
+CreateEmptyTopnSketch(int32 capacity)
+{
+	TopnSketch *sketch = (TopnSketch *) palloc0(TopnSketchHeaderSize);
+
+	SET_VARSIZE(sketch, TopnSketchHeaderSize);
+	sketch->version = TOPN_SKETCH_VERSION;
+	sketch->unionFactor = UnionFactor;
+	sketch->capacity = capacity;
+	sketch->itemCount = 0;
+
+	return sketch;
+}
+
+
+/*
+ * AddTextToTopnSketch adds the given amount to the frequency of the text item
+ * in the sketch, which must be a private copy. The counters are only rebuilt
+ * through a TopnAggState if the sketch has more items than its capacity, or if
+ * its keys are typed and have to be converted into text.
+ */
+static TopnSketch *
+AddTextToTopnSketch(TopnSketch *sketch, text *itemText, Frequency amount)
+{
+	TopnAggState *stateTopn = NULL;
+	uint32 itemLength = TopnKeyLength(VARDATA_ANY(itemText),
+									  VARSIZE_ANY_EXHDR(itemText));
+
+	/* an empty sketch keeps its evicted total when it takes text keys */
+	if (sketch->itemCount == 0 && TopnSketchKeyType(sketch) != TOPN_KEY_TEXT)
+	{
+		sketch->flags = TOPN_KEY_TEXT;
+	}
+
+	if (sketch->itemCount <= TopnSketchCapacity(sketch) &&
+		TopnSketchKeyType(sketch) == TOPN_KEY_TEXT)
+	{
+		return AddItemToTopnSketch(sketch, VARDATA_ANY(itemText), itemLength, amount);
+	}
+
+	/* the typed keys of the sketch are converted into text here */
+	stateTopn = CreateTopnAggState();
+	MergeTopnSketchIntoTopnAggState(sketch, stateTopn);
+	PrepareTopnAggStateKeyType(stateTopn, TOPN_KEY_TEXT);
+
+	if (AddItemToTopnAggState(stateTopn, VARDATA_ANY(itemText), itemLength, amount))
+	{
+		PruneTopnAggStateToCapacity(stateTopn);
+	}
+
+	return MaterializeAggStateToTopnSketch(stateTopn);
+}
+
+
+/*
+ * FindTopnSketchItem searches the key in the sorted items of the sketch. If the
+ * key is found, its index is returned in itemIndex. Otherwise, itemIndex is set
+ * to the position where the key should be inserted.
+ */
+static bool
+FindTopnSketchItem(TopnSketch *sketch, const char *keyData, uint32 keyLength,
+				   int *itemIndex)
+{
+	char *sketchKeyData = TopnSketchKeyData(sketch);
+	int lowIndex = 0;
+	int highIndex = sketch->itemCount;
+
+	while (lowIndex < highIndex)
+	{
+		int middleIndex = lowIndex + (highIndex - lowIndex) / 2;
+		TopnSketchItem *item = &sketch->items[middleIndex];
+		int result = CompareTopnKeys(sketchKeyData + item->keyOffset, item->keyLength,
+									 keyData, keyLength);
+
+		if (result == 0)
+		{
+			*itemIndex = middleIndex;
+			return true;
+		}
+		else if (result < 0)
+		{
+			lowIndex = middleIndex + 1;
+		}
+		else
+		{
+			highIndex = middleIndex;
+		}
+	}
+
+	*itemIndex = lowIndex;
+	return false;
+}
+
+
+/*
+ * LookupTopnSketchItem finds the counter of the item in the second argument in
+ * the topn value in the first argument, and copies its frequency and error into
+ * foundItem. It returns false if the item has no counter. The evicted total of
+ * the sketch is set in any case. Compact and expanded sketches are read as they
+ * are, so nothing but the detoasted value is allocated.
+ */
+static bool
+LookupTopnSketchItem(FunctionCallInfo fcinfo, TopnSketchItem *foundItem,
+					 Frequency *evictedTotal)
+{
+	ExpandedTopnSketch *expandedSketch = DatumGetExpandedTopnSketch(PG_GETARG_DATUM(0));
+	TopnSketch *sketch = NULL;
+	char keyBuffer[TOPN_UUID_TEXT_SIZE];
+	const char *keyData = NULL;
+	uint32 keyLength = 0;
+	int itemIndex = 0;
+
+	if (expandedSketch != NULL)
+	{
+		sketch = expandedSketch->sketch;
+	}
+	else
+	{
+		sketch = (TopnSketch *) PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+		CheckTopnSketchVersion(sketch);
+	}
+
+	*evictedTotal = sketch->evictedTotal;
+
+	if (!GetTopnLookupKey(fcinfo, TopnSketchKeyType(sketch), keyBuffer, &keyData,
+						  &keyLength))
+	{
+		return false;
+	}
+
+	if (TopnSketchIsCompact(sketch))
+	{
+		return FindCompactTopnSketchItem(sketch, keyData, keyLength, foundItem);
+	}
+
+	if (!FindTopnSketchItem(sketch, keyData, keyLength, &itemIndex))
+	{
+		return false;
+	}
+
+	*foundItem = sketch->items[itemIndex];
+
+	return true;
+}
+
+
+/*
+ * GetTopnLookupKey returns the key of the item in the second argument as it is
+ * stored in a sketch with the given key type. The keys of a typed sketch are
+ * compared to text items by their text forms, like when the sketch is converted
+ * into text. It returns false if the item cannot have a counter in such a
+ * sketch. The key is written into keyBuffer unless it is the text item itself.
+ */
+static bool
+GetTopnLookupKey(FunctionCallInfo fcinfo, uint8 keyType, char *keyBuffer,
+				 const char **keyData, uint32 *keyLength)
+{
+	Oid itemType = get_fn_expr_argtype(fcinfo->flinfo, 1);
+
+	*keyData = keyBuffer;
+
+	if (itemType == INT8OID)
+	{
+		int64 itemValue = PG_GETARG_INT64(1);
+
+		if (keyType == TOPN_KEY_INT8)
+		{
+			EncodeInt8Key(itemValue, keyBuffer);
+			*keyLength = TOPN_INT8_KEY_SIZE;
+			return true;
+		}
+		else if (keyType == TOPN_KEY_TEXT)
+		{
+			char itemString[TOPN_INT8_TEXT_SIZE + 1];
+
+			*keyLength = snprintf(itemString, sizeof(itemString), INT64_FORMAT, itemValue);
+			memcpy(keyBuffer, itemString, *keyLength);
+			return true;
+		}
+
+		return false;
+	}
+	else if (itemType == UUIDOID)
+	{
+		pg_uuid_t *itemUuid = PG_GETARG_UUID_P(1);
+
+		if (keyType == TOPN_KEY_UUID)
+		{
+			memcpy(keyBuffer, itemUuid->data, UUID_LEN);
+			*keyLength = UUID_LEN;
+			return true;
+		}
+		else if (keyType == TOPN_KEY_TEXT)
+		{
+			FormatUuidKey((const char *) itemUuid->data, keyBuffer);
+			*keyLength = TOPN_UUID_TEXT_SIZE;
+			return true;
+		}
+
+		return false;
+	}
+	else
+	{
+		text *itemText = PG_GETARG_TEXT_PP(1);
+		const char *textData = VARDATA_ANY(itemText);
+		uint32 textLength = TopnKeyLength(textData, VARSIZE_ANY_EXHDR(itemText));
+
+		if (keyType == TOPN_KEY_INT8)
+		{
+			*keyLength = TOPN_INT8_KEY_SIZE;
+			return ParseInt8Key(textData, textLength, keyBuffer);
+		}
+		else if (keyType == TOPN_KEY_UUID)
+		{
+			*keyLength = UUID_LEN;
+			return ParseUuidKey(textData, textLength, keyBuffer);
+		}
+
+		*keyData = textData;
+		*keyLength = textLength;
+		return true;
+	}
+}
+
+
+/*
+ * FindCompactTopnSketchItem is FindTopnSketchItem for a sketch in the compact
+ * encoding. The keys are rebuilt one after another in a buffer on the stack,
+ * and the scan stops at the first key which sorts after the given key.
+ */
+static bool
+FindCompactTopnSketchItem(TopnSketch *sketch, const char *keyData, uint32 keyLength,
+						  TopnSketchItem *foundItem)
+{
+	const char *dataPtr = TopnSketchCompactData(sketch);
+	const char *dataEnd = (char *) sketch + VARSIZE(sketch);
+	char currentKeyData[MAX_KEYSIZE];
+	uint32 keyTypeSize = TopnKeyTypeSize(TopnSketchKeyType(sketch));
+	uint64 currentKeyLength = 0;
+	int itemIndex = 0;
+
+	for (itemIndex = 0; itemIndex < sketch->itemCount; itemIndex++)
+	{
+		uint64 prefixLength = 0;
+		uint64 suffixLength = 0;
+		uint64 frequency = 0;
+		uint64 error = 0;
+		int result = 0;
+
+		dataPtr = ReadVarint(dataPtr, dataEnd, &prefixLength);
+		dataPtr = ReadVarint(dataPtr, dataEnd, &suffixLength);
+		if (prefixLength > currentKeyLength || suffixLength > dataEnd - dataPtr ||
+			prefixLength + suffixLength > MAX_KEYSIZE ||
+			(keyTypeSize != 0 && prefixLength + suffixLength != keyTypeSize))
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("corrupted compact topn value")));
+		}
+
+		memcpy(currentKeyData + prefixLength, dataPtr, suffixLength);
+		currentKeyLength = prefixLength + suffixLength;
+		dataPtr += suffixLength;
+
+		dataPtr = ReadVarint(dataPtr, dataEnd, &frequency);
+		dataPtr = ReadVarint(dataPtr, dataEnd, &error);
+		if (frequency > MAX_FREQUENCY || error > MAX_FREQUENCY)
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("corrupted compact topn value")));
+		}
+
+		result = CompareTopnKeys(currentKeyData, (uint32) currentKeyLength,
+								 keyData, keyLength);
+		if (result == 0)
+		{
+			foundItem->frequency = (Frequency) frequency;
+			foundItem->error = (Frequency) error;
+			return true;
+		}
+		else if (result > 0)
+		{
+			break;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * AddItemToTopnSketch adds the given amount to the frequency of the key in a
+ * sketch which has at most as many items as its capacity. If the key is found, its
+ * counter is increased in place, so the sketch must be a private copy. A new
+ * key is inserted in a new sketch. If the sketch is already full, the new key
+ * replaces the least frequent counter only when it is more frequent than that
+ * counter, which keeps the same items as pruning the counters would. The
+ * evicted total of the sketch is raised by the counter which is left out.
+ */
+static TopnSketch *
+AddItemToTopnSketch(TopnSketch *sketch, const char *keyData, uint32 keyLength,
+					Frequency amount)
+{
+	Frequency evictedTotal = sketch->evictedTotal;
+	TopnSketchItem *minimumItem = NULL;
+	int insertIndex = 0;
+	int minimumIndex = 0;
+	int itemIndex = 0;
+
+	if (FindTopnSketchItem(sketch, keyData, keyLength, &insertIndex))
+	{
+		IncreaseSketchItemFrequency(&sketch->items[insertIndex], amount);
+		return sketch;
+	}
+
+	if (sketch->itemCount < TopnSketchCapacity(sketch))
+	{
+		return CopyTopnSketchWithItem(sketch, insertIndex, keyData, keyLength, amount,
+									  evictedTotal, -1);
+	}
+
+	for (itemIndex = 1; itemIndex < sketch->itemCount; itemIndex++)
+	{
+		if (sketch->items[itemIndex].frequency < sketch->items[minimumIndex].frequency)
+		{
+			minimumIndex = itemIndex;
+		}
+	}
+
+	minimumItem = &sketch->items[minimumIndex];
+	if (minimumItem->frequency >= amount)
+	{
+		sketch->evictedTotal = AddFrequencies(evictedTotal, amount);
+		return sketch;
+	}
+
+	sketch->evictedTotal = Max(evictedTotal, AddFrequencies(minimumItem->frequency,
+															minimumItem->error));
+
+	return CopyTopnSketchWithItem(sketch, insertIndex, keyData, keyLength, amount,
+								  evictedTotal, minimumIndex);
+}
+
+
+/*
+ * CopyTopnSketchWithItem creates a copy of the sketch where the given key is
+ * inserted with the given frequency and error before the item at insertIndex.
+ * If removeIndex is not negative, the item at removeIndex is left out of the
+ * copy.
+ */
+static TopnSketch *
+CopyTopnSketchWithItem(TopnSketch *sketch, int insertIndex, const char *keyData,
+					   uint32 keyLength, Frequency frequency, Frequency error,
+					   int removeIndex)
+{
+	char *oldKeyData = TopnSketchKeyData(sketch);
+	TopnSketch *newSketch = NULL;
+	char *newKeyData = NULL;
+	Size keyDataSize = keyLength;
+	Size sketchSize = 0;
+	uint32 keyOffset = 0;
+	int newItemCount = sketch->itemCount + 1;
+	int newItemIndex = 0;
+	int itemIndex = 0;
+
+	for (itemIndex = 0; itemIndex < sketch->itemCount; itemIndex++)
+	{
+		keyDataSize += sketch->items[itemIndex].keyLength;
+	}
+
+	if (removeIndex >= 0)
+	{
+		keyDataSize -= sketch->items[removeIndex].keyLength;
+		newItemCount--;
+	}
+
+	sketchSize = TopnSketchHeaderSize + sizeof(TopnSketchItem) * newItemCount +
+				 keyDataSize;
+	if (!AllocSizeIsValid(sketchSize))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("topn sketch is too large")));
+	}
+
+	newSketch = (TopnSketch *) palloc0(sketchSize);
+	SET_VARSIZE(newSketch, sketchSize);
+	newSketch->version = TOPN_SKETCH_VERSION;
+	newSketch->flags = sketch->flags;
+	newSketch->unionFactor = sketch->unionFactor;
+	newSketch->capacity = sketch->capacity;
+	newSketch->itemCount = newItemCount;
+	newSketch->evictedTotal = sketch->evictedTotal;
+	newKeyData = TopnSketchKeyData(newSketch);
+
+	for (itemIndex = 0; itemIndex <= sketch->itemCount; itemIndex++)
+	{
+		TopnSketchItem *newItem = NULL;
+
+		if (itemIndex == insertIndex)
+		{
+			newItem = &newSketch->items[newItemIndex++];
+			newItem->frequency = frequency;
+			newItem->error = error;
+			newItem->keyOffset = keyOffset;
+			newItem->keyLength = keyLength;
+			memcpy(newKeyData + keyOffset, keyData, keyLength);
+			keyOffset += keyLength;
+		}
+
+		if (itemIndex == sketch->itemCount || itemIndex == removeIndex)
+		{
+			continue;
+		}
+
+		newItem = &newSketch->items[newItemIndex++];
+		*newItem = sketch->items[itemIndex];
+		newItem->keyOffset = keyOffset;
+		memcpy(newKeyData + keyOffset, oldKeyData + sketch->items[itemIndex].keyOffset,
+			   newItem->keyLength);
+		keyOffset += newItem->keyLength;
+	}
+
+	return newSketch;
+}
+
+
+/*
+ * MergeTopnSketchIntoTopnAggState adds the items of the given sketch into the
+ * TopnAggState. It prunes the counters in the same way MergeJsonbIntoTopnAggState
+ * does, but it reads the frequencies directly from the sketch.
+ */
+static void
+MergeTopnSketchIntoTopnAggState(TopnSketch *sketch, TopnAggState *topn)
+{
+	char *keyData = TopnSketchKeyData(sketch);
+	uint8 keyType = TopnSketchKeyType(sketch);
+	int itemIndex = 0;
+
+	MergeTopnCapacity(topn, sketch->capacity, sketch->unionFactor);
+
+	if (sketch->itemCount == 0)
+	{
+		BeginTopnMerge(topn, sketch->evictedTotal);
+		EndTopnMerge(topn, sketch->evictedTotal);
+		return;
+	}
+
+	PrepareTopnAggStateKeyType(topn, keyType);
+	BeginTopnMerge(topn, sketch->evictedTotal);
+
+	for (itemIndex = 0; itemIndex < sketch->itemCount; itemIndex++)
+	{
+		TopnSketchItem *item = &sketch->items[itemIndex];
+		int sizeOfHashTable = 0;
+		int remainingElements = 0;
+		int itemLimit = 0;
+
+		MergeTypedItemIntoTopnAggState(topn, keyType, keyData + item->keyOffset,
+									   item->keyLength, item->frequency, item->error,
+									   sketch->evictedTotal);
+		TopnStats.mergedItemCount++;
+
+		sizeOfHashTable = TopnAggStateItemCount(topn);
+		remainingElements = sizeOfHashTable / 2;
+		itemLimit = TopnAggStateItemLimit(topn);
+		PruneHashTable(topn, itemLimit, remainingElements);
+	}
+
+	EndTopnMerge(topn, sketch->evictedTotal);
+}
+
+
+/*
+ * MaterializeAggStateToTopnSketch creates a TopnSketch from the items of the
+ * given TopnAggState.
+ */
+static TopnSketch *
+MaterializeAggStateToTopnSketch(TopnAggState *topn)
+{
+	TopnCounterTable *hashTable = NULL;
+	long itemCount = TopnAggStateItemCount(topn);
+	FrequentTopnItem **sortedItemArray = NULL;
+	FrequentTopnItem *currentTask = NULL;
+	TopnCounterTableIterator iterator;
+	TopnSketch *sketch = NULL;
+	Size keyDataSize = 0;
+	Size sketchSize = 0;
+	char *keyData = NULL;
+	uint32 keyOffset = 0;
+	int itemIndex = 0;
+
+	UpdatePeakStateSize(topn);
+
+	if (itemCount == 0)
+	{
+		sketch = CreateEmptyTopnSketch(0);
+		sketch->evictedTotal = topn->evictedTotal;
+
+		return sketch;
+	}
+
+	sortedItemArray = palloc(sizeof(FrequentTopnItem *) * itemCount);
+
+	hashTable = topnHashtable(topn);
+	TopnCounterTableSeqInit(&iterator, hashTable);
+	while ((currentTask = TopnCounterTableSeqNext(&iterator)) != NULL)
+	{
+		sortedItemArray[itemIndex++] = currentTask;
+		keyDataSize += currentTask->key.length;
+	}
+
+	qsort(sortedItemArray, itemCount, sizeof(FrequentTopnItem *),
+		  compareFrequentTopnItemKey);
+
+	sketchSize = TopnSketchHeaderSize + sizeof(TopnSketchItem) * itemCount +
+				 keyDataSize;
+	if (!AllocSizeIsValid(sketchSize))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("topn sketch is too large")));
+	}
+
+	sketch = (TopnSketch *) palloc0(sketchSize);
+	SET_VARSIZE(sketch, sketchSize);
+	sketch->version = TOPN_SKETCH_VERSION;
+	sketch->flags = topn->keyType;
+	sketch->unionFactor = topn->unionFactor;
+	sketch->capacity = topn->capacity;
+	sketch->itemCount = itemCount;
+	sketch->evictedTotal = topn->evictedTotal;
+	keyData = TopnSketchKeyData(sketch);
+
+	for (itemIndex = 0; itemIndex < itemCount; itemIndex++)
+	{
+		FrequentTopnItem *topnItem = sortedItemArray[itemIndex];
+		TopnSketchItem *sketchItem = &sketch->items[itemIndex];
+		uint32 keyLength = topnItem->key.length;
+
+		sketchItem->frequency = topnItem->frequency;
+		sketchItem->error = TopnItemError(topn, topnItem);
+		sketchItem->keyOffset = keyOffset;
+		sketchItem->keyLength = keyLength;
+		memcpy(keyData + keyOffset, TopnItemKeyData(&topnItem->key), keyLength);
+
+		keyOffset += keyLength;
+	}
+
+	pfree(sortedItemArray);
+
+	return sketch;
+}
+
+
+/*
+ * Return TopnAggState's counter table. The table is created in the memory
+ * context of the TopnAggState when it is first needed.
+ */
+static TopnCounterTable *
+topnHashtable(TopnAggState *topn)
+{
+	if (topn->hashTable == NULL)
+	{
+		MemoryContext oldContext = MemoryContextSwitchTo(topn->context);
+
+		topn->hashTable = CreateTopnHashTable(TOPN_HASH_TABLE_INITIAL_SIZE);
+
+		MemoryContextSwitchTo(oldContext);
+	}
+
+	return topn->hashTable;
+}
+
+
+/*
+ * TopnAggStateItemCount returns the number of counters in the TopnAggState
+ * without creating its counter table.
+ */
+static long
+TopnAggStateItemCount(TopnAggState *topn)
+{
+	if (topn->hashTable == NULL)
+	{
+		return 0;
+	}
+
+	return topn->hashTable->itemCount;
+}
+
+
+/*
+ * Takes the TopnAggState in source and merges them into the destination
+ * TopnAggState. If there are the same key values, their frequencies are
+ * summed up and the unique ones are just taken as they are. The source is
+ * already pruned, so the destination is pruned once after all the counters
+ * of the source are merged, instead of checking it after every counter.
+ */
+static void
+MergeTopn(TopnAggState *destination, TopnAggState *source)
+{
+	TopnCounterTableIterator iterator;
+	FrequentTopnItem *currentTask = NULL;
+	int sizeOfHashTable = 0;
+	int remainingElements = 0;
+	int itemLimit = 0;
+
+	MergeTopnCapacity(destination, source->capacity, source->unionFactor);
+
+	if (TopnAggStateItemCount(source) == 0)
+	{
+		BeginTopnMerge(destination, source->evictedTotal);
+		EndTopnMerge(destination, source->evictedTotal);
+		return;
+	}
+
+	PrepareTopnAggStateKeyType(destination, source->keyType);
+	BeginTopnMerge(destination, source->evictedTotal);
+
+	TopnCounterTableSeqInit(&iterator, topnHashtable(source));
+
+	while ((currentTask = TopnCounterTableSeqNext(&iterator)) != NULL)
+	{
+		Frequency error = TopnItemError(source, currentTask);
+
+		TopnStats.mergedItemCount++;
+
+		/* the source key keeps its hash if it is not converted into text */
+		if (destination->keyType == source->keyType)
+		{
+			MergeItemKeyIntoTopnAggState(destination, &currentTask->key,
+										 currentTask->frequency, error,
+										 source->evictedTotal);
+		}
+		else
+		{
+			MergeTypedItemIntoTopnAggState(destination, source->keyType,
+										   TopnItemKeyData(&currentTask->key),
+										   currentTask->key.length,
+										   currentTask->frequency, error,
+										   source->evictedTotal);
+		}
+	}
+
+	sizeOfHashTable = TopnAggStateItemCount(destination);
+	itemLimit = TopnAggStateItemLimit(destination);
+	remainingElements = sizeOfHashTable / 2;
+
+	PruneHashTable(destination, itemLimit, remainingElements);
+
+	EndTopnMerge(destination, source->evictedTotal);
+}
+
+
+/*
+ * AddItemToTopnAggState adds the given amount to the frequency of the key. If
+ * the key is not in the counter table yet, a new counter is created for it and
+ * true is returned, so that the caller can prune the table if needed.
+ */
+static bool
+AddItemToTopnAggState(TopnAggState *topn, const char *keyData, uint32 keyLength,
+					  Frequency amount)
+{
+	return MergeItemIntoTopnAggState(topn, keyData, keyLength, amount, 0, 0);
+}
+
+
+/*
+ * AddCachedItemToTopnAggState works like AddItemToTopnAggState, but goes
+ * through the front cache of the TopnAggState first. On skewed inputs, most
+ * rows are one of a few keys, and they only cost a comparison of the key bytes
+ * with the key of the cached counter. The front cache never keeps any counts of
+ * its own, so the counter table always has the exact counts and the prune, the
+ * serialization and the packing of the state do not need to know about it.
+ */
+static bool
+AddCachedItemToTopnAggState(TopnAggState *topn, const char *keyData, uint32 keyLength,
+							Frequency amount)
+{
+	TopnCounterTable *hashTable = topnHashtable(topn);
+	TopnFrontCacheEntry *cacheEntry = NULL;
+	FrequentTopnItem *item = NULL;
+	TopnItemKey itemKey;
+	bool found = false;
+
+	if (topn->frontCache == NULL)
+	{
+		topn->frontCache = (TopnFrontCacheEntry *)
+			MemoryContextAllocZero(topn->context,
+								   TOPN_FRONT_CACHE_SIZE * sizeof(TopnFrontCacheEntry));
+	}
+
+	cacheEntry = &topn->frontCache[TopnFrontCacheIndex(keyData, keyLength)];
+	item = cacheEntry->item;
+
+	if (item != NULL && cacheEntry->generation == hashTable->generation &&
+		item->key.length == keyLength &&
+		memcmp(TopnItemKeyData(&item->key), keyData, keyLength) == 0)
+	{
+		IncreaseItemFrequency(item, amount);
+		return false;
+	}
+
+	InitTopnItemKey(&itemKey, topn->keyType, keyData, keyLength);
+	item = EnterItemKeyIntoTopnAggState(topn, &itemKey, amount, 0, 0, &found);
+
+	/* a new counter may have moved the others, which changes the generation */
+	cacheEntry->item = item;
+	cacheEntry->generation = hashTable->generation;
+
+	return !found;
+}
+
+
+/*
+ * TopnFrontCacheIndex returns the front cache entry of the key. The index is
+ * computed from the length and at most 8 bytes at each end of the key, which
+ * tell the keys apart well enough for a cache that is only a hint.
+ */
+static uint32
+TopnFrontCacheIndex(const char *keyData, uint32 keyLength)
+{
+	uint64 headWord = 0;
+	uint64 tailWord = 0;
+	uint64 keyWord = 0;
+
+	memcpy(&headWord, keyData, Min(keyLength, sizeof(uint64)));
+	if (keyLength > sizeof(uint64))
+	{
+		memcpy(&tailWord, keyData + keyLength - sizeof(uint64), sizeof(uint64));
+	}
+
+	keyWord = headWord ^ ((tailWord << 17) | (tailWord >> 47)) ^ keyLength;
+
+	return (uint32) ((keyWord * UINT64CONST(0x9E3779B97F4A7C15)) >>
+					 (64 - TOPN_FRONT_CACHE_BITS));
+}
+
+
+/*
+ * MergeItemIntoTopnAggState adds a counter of another sketch, with the given
+ * frequency and error, to the TopnAggState. It is called between BeginTopnMerge
+ * and EndTopnMerge with the evicted total of the other sketch.
+ */
+static bool
+MergeItemIntoTopnAggState(TopnAggState *topn, const char *keyData, uint32 keyLength,
+						  Frequency amount, Frequency error,
+						  Frequency sourceEvictedTotal)
+{
+	TopnItemKey itemKey;
+
+	InitTopnItemKey(&itemKey, topn->keyType, keyData, keyLength);
+
+	return MergeItemKeyIntoTopnAggState(topn, &itemKey, amount, error,
+										sourceEvictedTotal);
+}
+
+
+/*
+ * RemoveItemFromTopnAggState subtracts the given amount from the frequency of
+ * the key, and removes its counter if the frequency drops to zero. It is only
+ * used on states which were never pruned, so every removed key has a counter,
+ * but a missing one is ignored rather than trusted.
+ */
+static void
+RemoveItemFromTopnAggState(TopnAggState *topn, const char *keyData,
+						   uint32 keyLength, Frequency amount)
+{
+	TopnCounterTable *hashTable = topnHashtable(topn);
+	FrequentTopnItem *item = NULL;
+	TopnItemKey itemKey;
+	bool found = false;
+
+	InitTopnItemKey(&itemKey, topn->keyType, keyData, keyLength);
+
+	item = TopnCounterTableSearch(hashTable, &itemKey, false, &found);
+	if (!found)
+	{
+		return;
+	}
+
+	if (item->frequency > amount)
+	{
+		item->frequency -= amount;
+		return;
+	}
+
+	if (!TopnItemKeyIsInline(&item->key))
+	{
+		topn->liveKeySize -= item->key.length;
+	}
+
+	TopnCounterTableRemove(hashTable, item);
+
+	CompactTopnKeyArena(topn);
+}
+
+
+/*
+ * PrepareTopnAggStateKeyType makes the TopnAggState ready to take keys of the
+ * given type. An empty TopnAggState takes the key type as it is. If the keys of
+ * the TopnAggState have another type, they are converted into text, so that the
+ * keys of both types can be merged as text.
+ */
+static void
+PrepareTopnAggStateKeyType(TopnAggState *topn, uint8 keyType)
+{
+	if (topn->keyType == keyType)
+	{
+		return;
+	}
+
+	if (TopnAggStateItemCount(topn) == 0)
+	{
+		topn->keyType = keyType;
+	}
+	else if (topn->keyType != TOPN_KEY_TEXT)
+	{
+		ConvertTopnAggStateToText(topn);
+	}
+}
+
+
+/*
+ * MergeTypedItemIntoTopnAggState is the MergeItemIntoTopnAggState variant for a
+ * key of the given type, which is converted into text if the TopnAggState keeps
+ * another type of keys.
+ */
+static bool
+MergeTypedItemIntoTopnAggState(TopnAggState *topn, uint8 keyType, const char *keyData,
+							   uint32 keyLength, Frequency amount, Frequency error,
+							   Frequency sourceEvictedTotal)
+{
+	char *keyString = NULL;
+	bool newItem = false;
+
+	if (topn->keyType == keyType)
+	{
+		return MergeItemIntoTopnAggState(topn, keyData, keyLength, amount, error,
+										 sourceEvictedTotal);
+	}
+
+	keyString = TopnKeyToCString(keyType, keyData, keyLength);
+	newItem = MergeItemIntoTopnAggState(topn, keyString, strlen(keyString), amount,
+										error, sourceEvictedTotal);
+	pfree(keyString);
+
+	return newItem;
+}
+
+
+/*
+ * ConvertTopnAggStateToText converts the typed keys of the TopnAggState into
+ * text by moving its counters into a new counter table.
+ */
+static void
+ConvertTopnAggStateToText(TopnAggState *topn)
+{
+	TopnCounterTable *oldHashTable = topnHashtable(topn);
+	TopnKeyBlock *keyBlock = topn->keyBlocks;
+	uint8 oldKeyType = topn->keyType;
+	Frequency evictedTotal = topn->evictedTotal;
+	Frequency errorBase = topn->errorBase;
+	TopnCounterTableIterator iterator;
+	FrequentTopnItem *currentTask = NULL;
+
+	topn->hashTable = NULL;
+	topn->keyType = TOPN_KEY_TEXT;
+	topn->keyBlocks = NULL;
+	topn->allocatedKeySize = 0;
+	topn->liveKeySize = 0;
+
+	/* the counters are moved with their errors, which are not relative anymore */
+	topn->evictedTotal = 0;
+	topn->errorBase = 0;
+
+	TopnCounterTableSeqInit(&iterator, oldHashTable);
+	while ((currentTask = TopnCounterTableSeqNext(&iterator)) != NULL)
+	{
+		MergeTypedItemIntoTopnAggState(topn, oldKeyType,
+									   TopnItemKeyData(&currentTask->key),
+									   currentTask->key.length, currentTask->frequency,
+									   Max(AddSignedFrequencies(currentTask->error, errorBase), 0),
+									   0);
+	}
+
+	topn->evictedTotal = evictedTotal;
+
+	DestroyTopnCounterTable(oldHashTable);
+
+	/* the cached counters were in the old table */
+	if (topn->frontCache != NULL)
+	{
+		memset(topn->frontCache, 0, TOPN_FRONT_CACHE_SIZE * sizeof(TopnFrontCacheEntry));
+	}
+
+	while (keyBlock != NULL)
+	{
+		TopnKeyBlock *nextKeyBlock = keyBlock->next;
+
+		pfree(keyBlock);
+		keyBlock = nextKeyBlock;
+	}
+}
+
+
+/*
+ * AddTextArrayToTopnAggState adds every non-NULL item of the text array to the
+ * TopnAggState with a frequency of 1. It does not prune the counters, so the caller
+ * prunes it once after the whole array is added.
+ */
+static void
+AddTextArrayToTopnAggState(TopnAggState *topn, ArrayType *itemArray)
+{
+	Datum *itemDatumArray = NULL;
+	bool *itemNullArray = NULL;
+	int itemCount = 0;
+	int itemIndex = 0;
+
+	PrepareTopnAggStateKeyType(topn, TOPN_KEY_TEXT);
+
+	deconstruct_array(itemArray, TEXTOID, -1, false, 'i',
+					  &itemDatumArray, &itemNullArray, &itemCount);
+
+	for (itemIndex = 0; itemIndex < itemCount; itemIndex++)
+	{
+		text *itemText = NULL;
+		uint32 itemLength = 0;
+
+		if (itemNullArray[itemIndex])
+		{
+			continue;
+		}
+
+		itemText = DatumGetTextPP(itemDatumArray[itemIndex]);
+		itemLength = TopnKeyLength(VARDATA_ANY(itemText), VARSIZE_ANY_EXHDR(itemText));
+
+		AddItemToTopnAggState(topn, VARDATA_ANY(itemText), itemLength, 1);
+	}
+
+	pfree(itemDatumArray);
+	pfree(itemNullArray);
+}
+
+
+/*
+ * GetItemWeight checks the weight given to the weighted topn functions and
+ * returns it as a frequency.
+ */
+static Frequency
+GetItemWeight(int64 weight)
+{
+	if (weight < 0)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("the weight of an item cannot be negative")));
+	}
+
+	return (Frequency) weight;
+}
+
+
+/*
+ * GetTypedItemKeyType returns the key type for the type of the item argument
+ * of the bigint and uuid aggregates.
+ */
+static uint8
+GetTypedItemKeyType(FunctionCallInfo fcinfo)
+{
+	Oid itemType = get_fn_expr_argtype(fcinfo->flinfo, 1);
+
+	if (itemType == INT8OID)
+	{
+		return TOPN_KEY_INT8;
+	}
+	else if (itemType == UUIDOID)
+	{
+		return TOPN_KEY_UUID;
+	}
+
+	ereport(ERROR,
+			(errcode(ERRCODE_DATATYPE_MISMATCH),
+			 errmsg("topn cannot aggregate items of type %s",
+					format_type_be(itemType))));
+
+	return TOPN_KEY_TEXT;
+}
+
+
+/*
+ * EncodeTypedItemKey writes the key of a bigint or uuid item into keyData,
+ * which must have room for UUID_LEN bytes, and returns the length of the key.
+ */
+static uint32
+EncodeTypedItemKey(uint8 keyType, Datum item, char *keyData)
+{
+	if (keyType == TOPN_KEY_INT8)
+	{
+		EncodeInt8Key(DatumGetInt64(item), keyData);
+		return TOPN_INT8_KEY_SIZE;
+	}
+
+	memcpy(keyData, DatumGetUUIDP(item)->data, UUID_LEN);
+	return UUID_LEN;
+}
+
+
+/*
+ * MergeItemKeyIntoTopnAggState is the MergeItemIntoTopnAggState variant for an
+ * already hashed key. The key of a new counter is copied into the key arena of
+ * the TopnAggState, so the given key data does not need to outlive the call. A
+ * new counter may have missed as many occurrences as the evicted total of the
+ * TopnAggState, which is added to its error.
+ */
+static bool
+MergeItemKeyIntoTopnAggState(TopnAggState *topn, TopnItemKey *itemKey, Frequency amount,
+							 Frequency error, Frequency sourceEvictedTotal)
+{
+	bool found = false;
+
+	EnterItemKeyIntoTopnAggState(topn, itemKey, amount, error, sourceEvictedTotal,
+								 &found);
+
+	return !found;
+}
+
+
+/*
+ * EnterItemKeyIntoTopnAggState does the work of MergeItemKeyIntoTopnAggState
+ * and returns the counter of the key, which is valid until the next change of
+ * the counter table. The found flag is set if the counter was already there.
+ */
+static FrequentTopnItem *
+EnterItemKeyIntoTopnAggState(TopnAggState *topn, TopnItemKey *itemKey, Frequency amount,
+							 Frequency error, Frequency sourceEvictedTotal, bool *found)
+{
+	FrequentTopnItem *item = NULL;
+
+	item = TopnCounterTableSearch(topnHashtable(topn), itemKey, true, found);
+	if (*found)
+	{
+		/* the error base already counts the evicted total of the other sketch */
+		IncreaseItemFrequency(item, amount);
+		item->error = AddSignedFrequencies(item->error, error - sourceEvictedTotal);
+	}
+	else
+	{
+		StoreTopnItemKey(topn, &item->key);
+		item->frequency = amount;
+		item->error = AddFrequencies(error, topn->evictedTotal) - topn->errorBase;
+	}
+
+	return item;
+}
+
+
+/*
+ * BeginTopnMerge prepares the TopnAggState for merging a sketch with the given
+ * evicted total. The items of the TopnAggState which have no counter in that
+ * sketch may have been evicted from it, so its evicted total is added to the
+ * error of all counters. The counters which are in both get the error of the
+ * other counter instead, which MergeItemKeyIntoTopnAggState takes care of.
+ */
+static void
+BeginTopnMerge(TopnAggState *topn, Frequency sourceEvictedTotal)
+{
+	/* the errors of the counters take over the error base before it overflows */
+	if (MAX_FREQUENCY - topn->errorBase < sourceEvictedTotal)
+	{
+		FoldTopnErrorBase(topn);
+	}
+
+	topn->errorBase += sourceEvictedTotal;
+}
+
+
+/*
+ * EndTopnMerge finishes merging a sketch with the given evicted total. An item
+ * without a counter on either side may have been evicted from both, so the
+ * evicted totals are summed up.
+ */
+static void
+EndTopnMerge(TopnAggState *topn, Frequency sourceEvictedTotal)
+{
+	topn->evictedTotal = AddFrequencies(topn->evictedTotal, sourceEvictedTotal);
+}
+
+
+/*
+ * FoldTopnErrorBase adds the error base of the TopnAggState to the errors of
+ * all counters and sets it back to zero. The errors are capped at
+ * MAX_FREQUENCY then, like the error base would be.
+ */
+static void
+FoldTopnErrorBase(TopnAggState *topn)
+{
+	TopnCounterTableIterator iterator;
+	FrequentTopnItem *currentTask = NULL;
+
+	if (topn->hashTable != NULL)
+	{
+		TopnCounterTableSeqInit(&iterator, topn->hashTable);
+		while ((currentTask = TopnCounterTableSeqNext(&iterator)) != NULL)
+		{
+			currentTask->error = TopnItemError(topn, currentTask);
+		}
+	}
+
+	topn->errorBase = 0;
+}
+
+
+/*
+ * TopnItemError returns the error of the counter, which is the number of
+ * occurrences of its item the counter may have missed.
+ */
+static Frequency
+TopnItemError(TopnAggState *topn, FrequentTopnItem *item)
+{
+	return Max(AddSignedFrequencies(item->error, topn->errorBase), 0);
+}
+
+
+/*
+ * StoreTopnItemKey copies the data of a key which does not fit into a
+ * TopnItemKey into the key arena and points the key to the copy.
+ */
+static void
+StoreTopnItemKey(TopnAggState *topn, TopnItemKey *itemKey)
+{
+	TopnKeyBlock *keyBlock = topn->keyBlocks;
+	char *keyCopy = NULL;
+
+	if (TopnItemKeyIsInline(itemKey))
+	{
+		return;
+	}
+
+	if (keyBlock == NULL || keyBlock->size - keyBlock->usedSize < itemKey->length)
+	{
+		Size blockSize = TOPN_KEY_BLOCK_MIN_SIZE;
+
+		if (keyBlock != NULL)
+		{
+			blockSize = Min(keyBlock->size * 2, TOPN_KEY_BLOCK_MAX_SIZE);
+		}
+		blockSize = Max(blockSize, itemKey->length);
+
+		keyBlock = (TopnKeyBlock *) MemoryContextAlloc(topn->context,
+													   offsetof(TopnKeyBlock, data) +
+													   blockSize);
+		keyBlock->next = topn->keyBlocks;
+		keyBlock->size = blockSize;
+		keyBlock->usedSize = 0;
+
+		topn->keyBlocks = keyBlock;
+		topn->allocatedKeySize += blockSize;
+	}
+
+	keyCopy = keyBlock->data + keyBlock->usedSize;
+	memcpy(keyCopy, itemKey->value.external.data, itemKey->length);
+	keyBlock->usedSize += itemKey->length;
+	topn->liveKeySize += itemKey->length;
+
+	itemKey->value.external.data = keyCopy;
+}
+
+
+/*
+ * CompactTopnKeyArena copies the keys of the remaining counters into new
+ * blocks and frees the old ones when most of the arena belongs to the keys of
+ * pruned counters.
+ */
+static void
+CompactTopnKeyArena(TopnAggState *topn)
+{
+	TopnKeyBlock *keyBlock = topn->keyBlocks;
+	TopnCounterTableIterator iterator;
+	FrequentTopnItem *currentTask = NULL;
+
+	if (topn->allocatedKeySize <= TOPN_KEY_BLOCK_MAX_SIZE ||
+		topn->allocatedKeySize <= 2 * topn->liveKeySize)
+	{
+		return;
+	}
+
+	topn->keyBlocks = NULL;
+	topn->allocatedKeySize = 0;
+	topn->liveKeySize = 0;
+
+	/* the hash and the length of the keys do not change, only their location */
+	TopnCounterTableSeqInit(&iterator, topnHashtable(topn));
+	while ((currentTask = TopnCounterTableSeqNext(&iterator)) != NULL)
+	{
+		StoreTopnItemKey(topn, &currentTask->key);
+	}
+
+	while (keyBlock != NULL)
+	{
+		TopnKeyBlock *nextKeyBlock = keyBlock->next;
+
+		pfree(keyBlock);
+		keyBlock = nextKeyBlock;
+	}
+}
+
+
+/*
+ * InitTopnItemKey fills the TopnItemKey for the given key data and computes its
+ * hash. The bigint keys are hashed as integers, and the others as bytes. The
+ * long keys keep pointing to the given data until they are stored in the key
+ * arena.
+ */
+static void
+InitTopnItemKey(TopnItemKey *itemKey, uint8 keyType, const char *keyData,
+				uint32 keyLength)
+{
+	uint32 keyHash = 0;
+
+	if (keyType == TOPN_KEY_INT8)
+	{
+		uint64 keyValue = (uint64) DecodeInt8Key(keyData);
+
+		keyHash = DatumGetUInt32(hash_uint32((uint32) (keyValue ^ (keyValue >> 32))));
+	}
+	else
+	{
+		keyHash = DatumGetUInt32(hash_any((const unsigned char *) keyData, keyLength));
+	}
+
+	InitHashedTopnItemKey(itemKey, keyData, keyLength, keyHash);
+}
+
+
+/*
+ * InitHashedTopnItemKey is the InitTopnItemKey variant for a key whose hash is
+ * already known, such as the keys of a serialized TopnAggState.
+ */
+static void
+InitHashedTopnItemKey(TopnItemKey *itemKey, const char *keyData, uint32 keyLength,
+					  uint32 keyHash)
+{
+	memset(itemKey, 0, sizeof(TopnItemKey));
+	itemKey->hash = keyHash;
+	itemKey->length = keyLength;
+
+	if (TopnItemKeyIsInline(itemKey))
+	{
+		memcpy(itemKey->value.inlineData, keyData, keyLength);
+	}
+	else
+	{
+		memcpy(itemKey->value.external.prefix, keyData, TOPN_KEY_PREFIX_SIZE);
+		itemKey->value.external.data = keyData;
+	}
+}
+
+
+/*
+ * TopnKeyToCString returns the text form of the key as a palloc'd string. The
+ * typed keys are printed with the output format of their type.
+ */
+static char *
+TopnKeyToCString(uint8 keyType, const char *keyData, uint32 keyLength)
+{
+	if (keyType == TOPN_KEY_INT8)
+	{
+		return psprintf(INT64_FORMAT, DecodeInt8Key(keyData));
+	}
+	else if (keyType == TOPN_KEY_UUID)
+	{
+		return DatumGetCString(DirectFunctionCall1(uuid_out, PointerGetDatum(keyData)));
+	}
+
+	return pnstrdup(keyData, keyLength);
+}
+
+
+/*
+ * TopnKeyTypeSize returns the size of the keys of a fixed size key type, and 0
+ * for the text keys.
+ */
+static uint32
+TopnKeyTypeSize(uint8 keyType)
+{
+	if (keyType == TOPN_KEY_INT8)
+	{
+		return TOPN_INT8_KEY_SIZE;
+	}
+	else if (keyType == TOPN_KEY_UUID)
+	{
+		return UUID_LEN;
+	}
+
+	return 0;
+}
+
+
+/*
+ * EncodeInt8Key writes the bigint value as a key of TOPN_INT8_KEY_SIZE bytes
+ * whose bytewise order is the numeric order of the values.
+ */
+static void
+EncodeInt8Key(int64 value, char *keyData)
+{
+	uint64 keyValue = ((uint64) value) ^ (UINT64CONST(1) << 63);
+	int byteIndex = 0;
+
+	for (byteIndex = TOPN_INT8_KEY_SIZE - 1; byteIndex >= 0; byteIndex--)
+	{
+		keyData[byteIndex] = (char) (keyValue & 0xFF);
+		keyValue >>= 8;
+	}
+}
+
+
+/*
+ * DecodeInt8Key reads the bigint value of a key written by EncodeInt8Key.
+ */
+static int64
+DecodeInt8Key(const char *keyData)
+{
+	uint64 keyValue = 0;
+	int byteIndex = 0;
+
+	for (byteIndex = 0; byteIndex < TOPN_INT8_KEY_SIZE; byteIndex++)
+	{
+		keyValue = (keyValue << 8) | (unsigned char) keyData[byteIndex];
+	}
+
+	return (int64) (keyValue ^ (UINT64CONST(1) << 63));
+}
+
+
+/*
+ * ParseInt8Key writes the key of the bigint whose text form is the given text.
+ * It returns false if the text is not the way a bigint is printed, since such
+ * a text never matches a bigint key.
+ */
+static bool
+ParseInt8Key(const char *textData, uint32 textLength, char *keyData)
+{
+	char printedValue[TOPN_INT8_TEXT_SIZE + 1];
+	bool negative = (textLength > 0 && textData[0] == '-');
+	uint32 textIndex = negative ? 1 : 0;
+	uint64 absoluteValue = 0;
+	int64 value = 0;
+
+	/* the longest bigint has 19 digits, which cannot overflow here */
+	if (textLength == textIndex || textLength - textIndex > TOPN_INT8_TEXT_SIZE - 1)
+	{
+		return false;
+	}
+
+	for (; textIndex < textLength; textIndex++)
+	{
+		if (textData[textIndex] < '0' || textData[textIndex] > '9')
+		{
+			return false;
+		}
+
+		absoluteValue = absoluteValue * 10 + (textData[textIndex] - '0');
+	}
+
+	if (absoluteValue > (uint64) PG_INT64_MAX + (negative ? 1 : 0))
+	{
+		return false;
+	}
 
-				topnIndex++;
-			}
-		}
+	value = negative ? (int64) (0 - absoluteValue) : (int64) absoluteValue;
+
+	/* leading zeros and "-0" are not printed, so they do not match */
+	if (snprintf(printedValue, sizeof(printedValue), INT64_FORMAT, value) != textLength ||
+		memcmp(printedValue, textData, textLength) != 0)
+	{
+		return false;
 	}
 
-	return topnItemArray;
+	EncodeInt8Key(value, keyData);
+	return true;
 }
 
 
 /*
- * Creates an empty TopnAggState struct.
+ * ParseUuidKey writes the key of the uuid whose text form, as uuid_out prints
+ * it, is the given text. It returns false for any other text.
  */
-static TopnAggState *
-CreateTopnAggState(void)
+static bool
+ParseUuidKey(const char *textData, uint32 textLength, char *keyData)
 {
-	int32 hashTableSize = 0;
-	HASHCTL hashInfo;
-	int flags = HASH_ELEM | HASH_CONTEXT;
+	char printedUuid[TOPN_UUID_TEXT_SIZE];
+	uint32 textIndex = 0;
+	int byteIndex = 0;
 
-	hashTableSize = (NumberOfCounters / 0.75) + 1;
-	memset(&hashInfo, 0, sizeof(hashInfo));
-	hashInfo.keysize = MAX_KEYSIZE;
-	hashInfo.entrysize = sizeof(FrequentTopnItem);
-	hashInfo.hcxt = CurrentMemoryContext;
+	if (textLength != TOPN_UUID_TEXT_SIZE)
+	{
+		return false;
+	}
 
-#if PG_VERSION_NUM >= 140000
-	flags |= HASH_STRINGS;
-#endif
+	for (byteIndex = 0; byteIndex < UUID_LEN; byteIndex++)
+	{
+		int highDigit = 0;
+		int lowDigit = 0;
+
+		if (textData[textIndex] == '-')
+		{
+			textIndex++;
+		}
+
+		if (textIndex + 2 > textLength)
+		{
+			return false;
+		}
+
+		highDigit = HexDigitValue(textData[textIndex]);
+		lowDigit = HexDigitValue(textData[textIndex + 1]);
+		if (highDigit < 0 || lowDigit < 0)
+		{
+			return false;
+		}
+
+		keyData[byteIndex] = (char) ((highDigit << 4) | lowDigit);
+		textIndex += 2;
+	}
+
+	/* the hyphens must be where uuid_out puts them */
+	FormatUuidKey(keyData, printedUuid);
 
-	return (TopnAggState *) hash_create("Item Frequency Map", hashTableSize, &hashInfo,
-										flags);
+	return memcmp(printedUuid, textData, TOPN_UUID_TEXT_SIZE) == 0;
 }
 
 
 /*
- * MergeJsonbIntoTopnAggState extracts the topn object from a given Jsonb.
+ * FormatUuidKey writes the text form of the uuid key, as uuid_out prints it,
+ * into the TOPN_UUID_TEXT_SIZE bytes at textData.
  */
 static void
-MergeJsonbIntoTopnAggState(Jsonb *jsonb, TopnAggState *topn)
+FormatUuidKey(const char *keyData, char *textData)
 {
-	JsonbContainer *container = &jsonb->root;
-	JsonbIterator *iterator = JsonbIteratorInit(container);
-	JsonbIteratorToken jsonbIteratorToken;
-	JsonbValue itemJsonbValue;
-	char *valueNumAsString = NULL;
-	StringInfo key = makeStringInfo();
-	Frequency frequencyValue = 0;
-	bool found = false;
-	FrequentTopnItem *item = NULL;
+	static const char hexDigits[] = "0123456789abcdef";
+	int byteIndex = 0;
 
-	while ((jsonbIteratorToken = JsonbIteratorNext(&iterator, &itemJsonbValue, false)) !=
-		   WJB_DONE)
+	for (byteIndex = 0; byteIndex < UUID_LEN; byteIndex++)
 	{
-		if (jsonbIteratorToken == WJB_KEY && itemJsonbValue.type == jbvString)
-		{
-			/* json rules guarantee this is a string */
-			key = makeStringInfo();
-			appendBinaryStringInfo(key, itemJsonbValue.val.string.val,
-								   itemJsonbValue.val.string.len);
-			if (key->len > MAX_KEYSIZE)
-			{
-				ereport(ERROR,
-						(errcode(ERRCODE_DATA_EXCEPTION),
-						 errmsg("this jsonb object includes a key which is longer than "
-								"allowed topn key size (256 bytes)")));
-			}
-
-			jsonbIteratorToken = JsonbIteratorNext(&iterator, &itemJsonbValue, false);
-			if (jsonbIteratorToken == WJB_VALUE && itemJsonbValue.type == jbvNumeric)
-			{
-				int sizeOfHashTable = 0;
-				int remainingElements = 0;
-				int itemLimit = 0;
-				valueNumAsString = numeric_normalize(itemJsonbValue.val.numeric);
-				frequencyValue = atol(valueNumAsString);
-
-				item = hash_search(topnHashtable(topn), (void *) key->data,
-								   HASH_ENTER, &found);
-				if (found)
-				{
-					IncreaseItemFrequency(item, frequencyValue);
-				}
-				else
-				{
-					item->frequency = frequencyValue;
-				}
+		unsigned char keyByte = (unsigned char) keyData[byteIndex];
 
-				sizeOfHashTable = hash_get_num_entries(topnHashtable(topn));
-				remainingElements = sizeOfHashTable / 2;
-				itemLimit = NumberOfCounters * UnionFactor;
-				PruneHashTable(topnHashtable(topn), itemLimit, remainingElements);
-			}
+		if (byteIndex == 4 || byteIndex == 6 || byteIndex == 8 || byteIndex == 10)
+		{
+			*textData++ = '-';
 		}
+
+		*textData++ = hexDigits[keyByte >> 4];
+		*textData++ = hexDigits[keyByte & 0x0F];
 	}
 }
 
 
 /*
- * Comparator function for FrequentTopnItem struct to be able to sort
- * the array of it with qsort of stdlib.
+ * HexDigitValue returns the value of a lower case hexadecimal digit, or -1 for
+ * any other character.
  */
 static int
-compareFrequentTopnItem(const void *item1, const void *item2)
+HexDigitValue(char digit)
 {
-	Frequency freq1 = ((FrequentTopnItem *) item1)->frequency;
-	Frequency freq2 = ((FrequentTopnItem *) item2)->frequency;
-	if (freq1 == freq2)
+	if (digit >= '0' && digit <= '9')
 	{
-		return 0;
-	}
-	else if (freq1 > freq2)
-	{
-		return -1;
+		return digit - '0';
 	}
-	else
+	else if (digit >= 'a' && digit <= 'f')
 	{
-		return 1;
+		return digit - 'a' + 10;
 	}
+
+	return -1;
 }
 
 
 /*
- * topnGetDatum converts the FrequentTopnItem passed to it into its datum
- * representation. To do this, the function first creates the heap tuple from
- * the topn key and value. Then, the function converts the heap tuple
- * into a datum and returns it.
+ * TopnKeyLength returns how many bytes of the given text are used as a key.
+ * The text is clipped at a character boundary to less than MAX_KEYSIZE bytes.
  */
-static Datum
-topnGetDatum(FrequentTopnItem *topnItem, TupleDesc tupleDescriptor)
+static uint32
+TopnKeyLength(const char *keyData, int keyLength)
 {
-	Datum values[2];
-	bool isNulls[2];
-	HeapTuple topnTuple = NULL;
-	Datum topnDatum = 0;
-
-	memset(values, 0, sizeof(values));
-	memset(isNulls, false, sizeof(isNulls));
-
-	values[0] = CStringGetTextDatum(topnItem->key);
-	values[1] = Int64GetDatum((Frequency) topnItem->frequency);
-
-	topnTuple = heap_form_tuple(tupleDescriptor, values, isNulls);
-	topnDatum = HeapTupleGetDatum(topnTuple);
+	if (keyLength >= MAX_KEYSIZE)
+	{
+		return pg_mbcliplen(keyData, keyLength, MAX_KEYSIZE - 1);
+	}
 
-	return topnDatum;
+	return keyLength;
 }
 
 
 /*
- * PruneHashTable removes some items from the HashTable to decrease its size. It finds
- * minimum and maximum frequencies first and removes the items which have lower frequency
- * than the average of them.
+ * CompareTopnKeys compares the keys bytewise, which gives the same order strcmp
+ * gives for the text keys.
  */
-static void
-PruneHashTable(HTAB *hashTable, int itemLimit, int numberOfRemainingElements)
+static int
+CompareTopnKeys(const char *keyData1, uint32 keyLength1,
+				const char *keyData2, uint32 keyLength2)
 {
-	Size topnArraySize = 0;
-	int topnIndex = 0;
-	FrequentTopnItem *sortedTopnArray = NULL;
-	bool itemAlreadyHashed = false;
-	HASH_SEQ_STATUS status;
-	FrequentTopnItem *currentTask = NULL;
-	int index = 0;
-	int hashTableSize = hash_get_num_entries(hashTable);
+	int result = memcmp(keyData1, keyData2, Min(keyLength1, keyLength2));
 
-	if (hashTableSize <= itemLimit)
+	if (result != 0)
 	{
-		return;
+		return result;
 	}
-
-	/* create an array to copy top-n items and sort them later */
-	topnArraySize = sizeof(FrequentTopnItem) * hashTableSize;
-	sortedTopnArray = (FrequentTopnItem *) palloc(topnArraySize);
-
-	hash_seq_init(&status, hashTable);
-
-	while ((currentTask = (FrequentTopnItem *) hash_seq_search(&status)) != NULL)
+	else if (keyLength1 < keyLength2)
 	{
-		memcpy(&sortedTopnArray[topnIndex], currentTask, sizeof(*currentTask));
-		topnIndex++;
+		return -1;
 	}
-
-	qsort(sortedTopnArray, hashTableSize, sizeof(FrequentTopnItem),
-		  compareFrequentTopnItem);
-
-	for (index = numberOfRemainingElements; index < hashTableSize; index++)
+	else if (keyLength1 > keyLength2)
 	{
-		FrequentTopnItem *topnItem = &(sortedTopnArray[index]);
-
-		hash_search(hashTable, (void *) topnItem->key, HASH_REMOVE,
-					&itemAlreadyHashed);
+		return 1;
 	}
+
+	return 0;
 }
 
 
 /*
- * MaterializeAggStateToJsonb extracts the jsonb object from a given HTAB
+ * TopnItemKeysEqual compares two keys. The hash, the length and the inline part
+ * are compared first, so the key arena is only read for probable matches.
  */
-static Jsonb *
-MaterializeAggStateToJsonb(TopnAggState *topn)
+static bool
+TopnItemKeysEqual(const TopnItemKey *itemKey1, const TopnItemKey *itemKey2)
 {
-	StringInfo jsonbStr = makeStringInfo();
-	HASH_SEQ_STATUS status;
-	FrequentTopnItem *currentTask = NULL;
-	Jsonb *result = NULL;
-
-	appendStringInfo(jsonbStr, "{");
-
-	hash_seq_init(&status, topnHashtable(topn));
-	if ((currentTask = (FrequentTopnItem *) hash_seq_search(&status)) != NULL)
+	if (itemKey1->hash != itemKey2->hash || itemKey1->length != itemKey2->length)
 	{
-		InsertPairs(currentTask, jsonbStr);
-		while ((currentTask = (FrequentTopnItem *) hash_seq_search(&status)) != NULL)
-		{
-			appendStringInfo(jsonbStr, ", ");
-			InsertPairs(currentTask, jsonbStr);
-		}
+		return false;
 	}
 
-	appendStringInfo(jsonbStr, "}");
-	result = jsonb_from_cstring(jsonbStr->data, jsonbStr->len);
-
-	return result;
-}
+	if (TopnItemKeyIsInline(itemKey1))
+	{
+		return memcmp(itemKey1->value.inlineData, itemKey2->value.inlineData,
+					  itemKey1->length) == 0;
+	}
 
+	if (memcmp(itemKey1->value.external.prefix, itemKey2->value.external.prefix,
+			   TOPN_KEY_PREFIX_SIZE) != 0)
+	{
+		return false;
+	}
 
-/* Return TopnAggState's HTAB reference. */
-static HTAB *
-topnHashtable(TopnAggState *topn)
-{
-	return (HTAB *) topn;
+	return memcmp(itemKey1->value.external.data, itemKey2->value.external.data,
+				  itemKey1->length) == 0;
 }
 
 
 /*
- * Takes the TopnAggState in source and merges them into the destination
- * TopnAggState. If there are the same key values, their frequencies are
- * summed up and the unique ones are just taken as they are.
+ * TopnCounterTableSearch looks up the counter of the key. If the key has no
+ * counter and enter is true, a new counter is created for it, whose key is
+ * copied from the given key and whose counts are left to the caller. Creating
+ * a counter may move the other counters, so pointers to them do not survive it.
  */
-static void
-MergeTopn(TopnAggState *destination, TopnAggState *source)
+static FrequentTopnItem *
+TopnCounterTableSearch(TopnCounterTable *table, const TopnItemKey *itemKey, bool enter,
+					   bool *found)
 {
-	bool found = false;
-	HASH_SEQ_STATUS status;
-	FrequentTopnItem *currentTask = NULL;
-	char *key = NULL;
+	uint32 groupMask = 0;
+	uint32 groupIndex = 0;
+	uint32 probeCount = 0;
+	uint8 control = TopnHashControl(itemKey->hash);
+	uint64 controlPattern = TOPN_GROUP_LOW_BITS * control;
+	int64 insertSlot = -1;
 	FrequentTopnItem *item = NULL;
 
-	hash_seq_init(&status, topnHashtable(source));
+	/* the table is grown or cleaned up before it gets full */
+	if (enter && (table->itemCount + table->deletedCount + 1) > table->slotCount / 8 * 7)
+	{
+		uint32 slotCount = table->slotCount;
+
+		if (table->itemCount + 1 > slotCount / 16 * 7)
+		{
+			slotCount *= 2;
+		}
+
+		ResizeTopnCounterTable(table, slotCount);
+	}
+
+	groupMask = table->slotCount / TOPN_TABLE_GROUP_SIZE - 1;
+	groupIndex = TopnHashGroup(itemKey->hash) & groupMask;
 
-	while ((currentTask = (FrequentTopnItem *) hash_seq_search(&status)) != NULL)
+	while (true)
 	{
-		int sizeOfHashTable = 0;
-		int remainingElements = 0;
-		int itemLimit = 0;
-		key = currentTask->key;
+		uint32 firstSlot = groupIndex * TOPN_TABLE_GROUP_SIZE;
+		uint8 *groupControl = table->controlBytes + firstSlot;
+		uint64 controlWord = 0;
+		uint64 matchWord = 0;
+		int slotOffset = 0;
+
+		memcpy(&controlWord, groupControl, sizeof(uint64));
 
-		item = hash_search(topnHashtable(destination), (void *) key, HASH_ENTER, &found);
+		/* a byte of matchWord is zero where the control byte matches */
+		matchWord = controlWord ^ controlPattern;
+		if (((matchWord - TOPN_GROUP_LOW_BITS) & ~matchWord & TOPN_GROUP_HIGH_BITS) != 0)
+		{
+			for (slotOffset = 0; slotOffset < TOPN_TABLE_GROUP_SIZE; slotOffset++)
+			{
+				if (groupControl[slotOffset] != control)
+				{
+					continue;
+				}
+
+				item = &table->items[firstSlot + slotOffset];
+				if (TopnItemKeysEqual(&item->key, itemKey))
+				{
+					*found = true;
+					return item;
+				}
+			}
+		}
 
-		if (found)
+		/* the high bit is set for the empty and the deleted slots */
+		if (insertSlot < 0 && (controlWord & TOPN_GROUP_HIGH_BITS) != 0)
 		{
-			IncreaseItemFrequency(item, currentTask->frequency);
+			for (slotOffset = 0; slotOffset < TOPN_TABLE_GROUP_SIZE; slotOffset++)
+			{
+				if (!TopnControlIsFull(groupControl[slotOffset]))
+				{
+					insertSlot = firstSlot + slotOffset;
+					break;
+				}
+			}
 		}
-		else
+
+		/* only the empty slots have the high bit set and the second lowest unset */
+		if ((controlWord & ~(controlWord << 6) & TOPN_GROUP_HIGH_BITS) != 0)
 		{
-			item->frequency = currentTask->frequency;
+			break;
 		}
 
-		sizeOfHashTable = hash_get_num_entries(topnHashtable(destination));
-		itemLimit = NumberOfCounters * UnionFactor;
-		remainingElements = sizeOfHashTable / 2;
+		/* the triangular probe sequence visits every group once */
+		probeCount++;
+		groupIndex = (groupIndex + probeCount) & groupMask;
+	}
+
+	*found = false;
+
+	if (!enter)
+	{
+		return NULL;
+	}
 
-		PruneHashTable(topnHashtable(destination), itemLimit, remainingElements);
+	if (table->controlBytes[insertSlot] == TOPN_CONTROL_DELETED)
+	{
+		table->deletedCount--;
 	}
+
+	table->controlBytes[insertSlot] = control;
+	table->itemCount++;
+
+	item = &table->items[insertSlot];
+	item->key = *itemKey;
+
+	return item;
 }
 
 
 /*
- * IncreaseItemFrequency is used to increase the frequency in a controlled manner
- * to avoid overflow issues.
+ * TopnCounterTableRemove removes the given counter from the table. If the
+ * group of the counter still has an empty slot, no lookup has ever continued
+ * past the group, so the slot can become empty again. Otherwise, it is marked
+ * as deleted, so that the lookups continue to the next group.
  */
 static void
-IncreaseItemFrequency(FrequentTopnItem *item, Frequency amount)
+TopnCounterTableRemove(TopnCounterTable *table, FrequentTopnItem *item)
 {
-	Frequency freq = item->frequency;
-	if (MAX_FREQUENCY - freq < amount)
+	uint32 slotIndex = item - table->items;
+	uint32 firstSlot = slotIndex - slotIndex % TOPN_TABLE_GROUP_SIZE;
+	uint64 controlWord = 0;
+
+	memcpy(&controlWord, table->controlBytes + firstSlot, sizeof(uint64));
+
+	if ((controlWord & ~(controlWord << 6) & TOPN_GROUP_HIGH_BITS) != 0)
 	{
-		item->frequency = MAX_FREQUENCY;
+		table->controlBytes[slotIndex] = TOPN_CONTROL_EMPTY;
 	}
 	else
 	{
-		item->frequency += amount;
+		table->controlBytes[slotIndex] = TOPN_CONTROL_DELETED;
+		table->deletedCount++;
 	}
+
+	table->itemCount--;
+	table->generation++;
 }
 
 
 /*
- * The given elements in FrequentTopnItem are put into the jsonbStr by escaping
- * the keys properly.
+ * ResizeTopnCounterTable moves the counters into new slot and control arrays of
+ * the given size, which also drops the deleted slots. The slots and the control
+ * bytes are allocated together in the memory context of the table.
  */
 static void
-InsertPairs(FrequentTopnItem *item, StringInfo jsonbStr)
+ResizeTopnCounterTable(TopnCounterTable *table, uint32 slotCount)
 {
-	StringInfo keyJsonb = makeStringInfo();
-	escape_json(keyJsonb, item->key);
-
-	appendStringInfo(jsonbStr, "%s", keyJsonb->data);
-	appendStringInfo(jsonbStr, ":");
-	appendStringInfo(jsonbStr, "%ld", item->frequency);
-}
-
+	FrequentTopnItem *oldItems = table->items;
+	uint8 *oldControlBytes = table->controlBytes;
+	uint32 oldSlotCount = table->slotCount;
+	uint32 slotIndex = 0;
+	char *slotData = NULL;
+
+	slotData = MemoryContextAllocHuge(table->context,
+									  (Size) slotCount *
+									  (sizeof(FrequentTopnItem) + sizeof(uint8)));
+
+	table->items = (FrequentTopnItem *) slotData;
+	table->controlBytes = (uint8 *) (slotData + (Size) slotCount * sizeof(FrequentTopnItem));
+	table->slotCount = slotCount;
+	table->deletedCount = 0;
+	table->generation++;
+	memset(table->controlBytes, TOPN_CONTROL_EMPTY, slotCount);
+
+	for (slotIndex = 0; slotIndex < oldSlotCount; slotIndex++)
+	{
+		FrequentTopnItem *oldItem = &oldItems[slotIndex];
+		uint32 newSlot = 0;
 
-/* *INDENT-OFF* */
-/* DISCLAIMER: COPY-PASTED FROM POSTGRES SOURCE CODE */
-static JsonParseErrorType_compat
-jsonb_in_object_start(void *pstate)
-{
-	JsonbInState *_state = (JsonbInState *) pstate;
+		if (!TopnControlIsFull(oldControlBytes[slotIndex]))
+		{
+			continue;
+		}
 
-	_state->res = pushJsonbValue(&_state->parseState, WJB_BEGIN_OBJECT, NULL);
+		newSlot = FindEmptyTopnCounterSlot(table, oldItem->key.hash);
+		table->controlBytes[newSlot] = oldControlBytes[slotIndex];
+		table->items[newSlot] = *oldItem;
+	}
 
-	return JSON_SUCCESS_COMPAT;
+	if (oldItems != NULL)
+	{
+		pfree(oldItems);
+	}
 }
 
-static JsonParseErrorType_compat
-jsonb_in_object_end(void *pstate)
+
+/*
+ * FindEmptyTopnCounterSlot returns the first empty slot on the probe sequence
+ * of the hash. It is only used while the table has no deleted slots and is
+ * known not to have the key.
+ */
+static uint32
+FindEmptyTopnCounterSlot(TopnCounterTable *table, uint32 keyHash)
 {
-	JsonbInState *_state = (JsonbInState *) pstate;
+	uint32 groupMask = table->slotCount / TOPN_TABLE_GROUP_SIZE - 1;
+	uint32 groupIndex = TopnHashGroup(keyHash) & groupMask;
+	uint32 probeCount = 0;
 
-	_state->res = pushJsonbValue(&_state->parseState, WJB_END_OBJECT, NULL);
+	while (true)
+	{
+		uint32 firstSlot = groupIndex * TOPN_TABLE_GROUP_SIZE;
+		int slotOffset = 0;
 
-	return JSON_SUCCESS_COMPAT;
-}
+		for (slotOffset = 0; slotOffset < TOPN_TABLE_GROUP_SIZE; slotOffset++)
+		{
+			if (table->controlBytes[firstSlot + slotOffset] == TOPN_CONTROL_EMPTY)
+			{
+				return firstSlot + slotOffset;
+			}
+		}
 
-static JsonParseErrorType_compat
-jsonb_in_array_start(void *pstate)
-{
-	JsonbInState *_state = (JsonbInState *) pstate;
+		probeCount++;
+		groupIndex = (groupIndex + probeCount) & groupMask;
+	}
+}
 
-	_state->res = pushJsonbValue(&_state->parseState, WJB_BEGIN_ARRAY, NULL);
 
-	return JSON_SUCCESS_COMPAT;
+/* TopnCounterTableSeqInit starts a scan over the counters of the table. */
+static void
+TopnCounterTableSeqInit(TopnCounterTableIterator *iterator, TopnCounterTable *table)
+{
+	iterator->table = table;
+	iterator->slotIndex = 0;
 }
 
-static JsonParseErrorType_compat
-jsonb_in_array_end(void *pstate)
-{
-	JsonbInState *_state = (JsonbInState *) pstate;
 
-	_state->res = pushJsonbValue(&_state->parseState, WJB_END_ARRAY, NULL);
+/*
+ * TopnCounterTableSeqNext returns the next counter of the scan, or NULL when
+ * all of them are returned. The counters may be removed during the scan, but
+ * no counters may be added.
+ */
+static FrequentTopnItem *
+TopnCounterTableSeqNext(TopnCounterTableIterator *iterator)
+{
+	TopnCounterTable *table = iterator->table;
 
-	return JSON_SUCCESS_COMPAT;
-}
+	while (iterator->slotIndex < table->slotCount)
+	{
+		uint32 slotIndex = iterator->slotIndex++;
 
-static JsonParseErrorType_compat
-jsonb_in_object_field_start(void *pstate, char *fname, bool isnull)
-{
-	JsonbInState *_state = (JsonbInState *) pstate;
-	JsonbValue	v;
+		if (TopnControlIsFull(table->controlBytes[slotIndex]))
+		{
+			return &table->items[slotIndex];
+		}
+	}
 
-	Assert(fname != NULL);
-	v.type = jbvString;
-	v.val.string.len = checkStringLen(strlen(fname));
-	v.val.string.val = fname;
+	return NULL;
+}
 
-	_state->res = pushJsonbValue(&_state->parseState, WJB_KEY, &v);
 
-	return JSON_SUCCESS_COMPAT;
+/* DestroyTopnCounterTable frees the memory of the table. */
+static void
+DestroyTopnCounterTable(TopnCounterTable *table)
+{
+	pfree(table->items);
+	pfree(table);
 }
 
+
 /*
- * For jsonb we always want the de-escaped value - that's what's in token
+ * TopnCounterTableSize estimates the memory of a counter table with the given
+ * number of counters, right after it has grown to hold them.
  */
-static JsonParseErrorType_compat
-jsonb_in_scalar(void *pstate, char *token, JsonTokenType tokentype)
+static Size
+TopnCounterTableSize(long itemCount)
 {
-	JsonbInState *_state = (JsonbInState *) pstate;
-	JsonbValue	v;
+	Size slotCount = TOPN_TABLE_GROUP_SIZE;
 
-	switch (tokentype)
+	while (slotCount / 8 * 7 < itemCount)
 	{
+		slotCount *= 2;
+	}
 
-		case JSON_TOKEN_STRING:
-			Assert(token != NULL);
-			v.type = jbvString;
-			v.val.string.len = checkStringLen(strlen(token));
-			v.val.string.val = token;
-			break;
-		case JSON_TOKEN_NUMBER:
-
-			/*
-			 * No need to check size of numeric values, because maximum
-			 * numeric size is well below the JsonbValue restriction
-			 */
-			Assert(token != NULL);
-			v.type = jbvNumeric;
-			v.val.numeric = DatumGetNumeric(DirectFunctionCall3(numeric_in, CStringGetDatum(token), 0, -1));
-
-			break;
-		case JSON_TOKEN_TRUE:
-			v.type = jbvBool;
-			v.val.boolean = true;
+	return sizeof(TopnCounterTable) +
+		   slotCount * (sizeof(FrequentTopnItem) + sizeof(uint8));
+}
 
-			break;
-		case JSON_TOKEN_FALSE:
-			v.type = jbvBool;
-			v.val.boolean = false;
 
-			break;
-		case JSON_TOKEN_NULL:
-			v.type = jbvNull;
-			break;
-		default:
-			/* should not be possible */
-			elog(ERROR, "invalid json token type");
-			break;
+/*
+ * IncreaseItemFrequency is used to increase the frequency in a controlled manner
+ * to avoid overflow issues.
+ */
+static void
+IncreaseItemFrequency(FrequentTopnItem *item, Frequency amount)
+{
+	Frequency freq = item->frequency;
+	if (MAX_FREQUENCY - freq < amount)
+	{
+		item->frequency = MAX_FREQUENCY;
 	}
-
-	if (_state->parseState == NULL)
+	else
 	{
-		/* single scalar */
-		JsonbValue	va;
+		item->frequency += amount;
+	}
+}
 
-		va.type = jbvArray;
-		va.val.array.rawScalar = true;
-		va.val.array.nElems = 1;
 
-		_state->res = pushJsonbValue(&_state->parseState, WJB_BEGIN_ARRAY, &va);
-		_state->res = pushJsonbValue(&_state->parseState, WJB_ELEM, &v);
-		_state->res = pushJsonbValue(&_state->parseState, WJB_END_ARRAY, NULL);
+/*
+ * IncreaseSketchItemFrequency is the IncreaseItemFrequency function for the
+ * items of a TopnSketch.
+ */
+static void
+IncreaseSketchItemFrequency(TopnSketchItem *item, Frequency amount)
+{
+	Frequency freq = item->frequency;
+	if (MAX_FREQUENCY - freq < amount)
+	{
+		item->frequency = MAX_FREQUENCY;
 	}
 	else
 	{
-		JsonbValue *o = &_state->parseState->contVal;
-
-		switch (o->type)
-		{
-			case jbvArray:
-				_state->res = pushJsonbValue(&_state->parseState, WJB_ELEM, &v);
-				break;
-			case jbvObject:
-				_state->res = pushJsonbValue(&_state->parseState, WJB_VALUE, &v);
-				break;
-			default:
-				elog(ERROR, "unexpected parent of nested structure");
-		}
+		item->frequency += amount;
 	}
-
-	return JSON_SUCCESS_COMPAT;
 }
 
 
 /*
- * jsonb_from_cstring
- *
- * Turns json string into a jsonb Datum.
- *
- * Uses the json parser (with hooks) to construct a jsonb.
+ * AddFrequencies returns the sum of the frequencies, which is capped at
+ * MAX_FREQUENCY like the frequencies of the counters are.
  */
-static Jsonb *
-jsonb_from_cstring(char *json, int len)
+static Frequency
+AddFrequencies(Frequency frequency1, Frequency frequency2)
 {
-	JsonLexContext *lex = NULL;
-	JsonbInState state;
-	JsonSemAction sem;
-
-	memset(&state, 0, sizeof(state));
-	memset(&sem, 0, sizeof(sem));
-	lex = makeJsonLexContextCstringLenCompat(lex, json, len, GetDatabaseEncoding(), true);
+	if (MAX_FREQUENCY - frequency1 < frequency2)
+	{
+		return MAX_FREQUENCY;
+	}
 
-	sem.semstate = (void *) &state;
+	return frequency1 + frequency2;
+}
 
-	sem.object_start = jsonb_in_object_start;
-	sem.array_start = jsonb_in_array_start;
-	sem.object_end = jsonb_in_object_end;
-	sem.array_end = jsonb_in_array_end;
-	sem.scalar = jsonb_in_scalar;
-	sem.object_field_start = jsonb_in_object_field_start;
 
-	pg_parse_json(lex, &sem);
+/*
+ * AddSignedFrequencies is AddFrequencies for the relative errors of the
+ * counters, which may be negative. The sum is capped at -MAX_FREQUENCY and
+ * MAX_FREQUENCY.
+ */
+static Frequency
+AddSignedFrequencies(Frequency frequency1, Frequency frequency2)
+{
+	if (frequency2 > 0 && MAX_FREQUENCY - frequency2 < frequency1)
+	{
+		return MAX_FREQUENCY;
+	}
+	else if (frequency2 < 0 && -MAX_FREQUENCY - frequency2 > frequency1)
+	{
+		return -MAX_FREQUENCY;
+	}
 
-	/* after parsing, the item member has the composed jsonb structure */
-	return JsonbValueToJsonb(state.res);
+	return frequency1 + frequency2;
 }
 
 
@@ -0,0 +1,563 @@
+/* topn--2.7.0--2.8.0 */
+
+/* bump version to 2.8.0 */
+#if PG_VERSION_NUM < 100000
+#define IFPARALLEL(...)
+#else
+#define IFPARALLEL(...) __VA_ARGS__
+#endif
+
+-- binary topn type
+CREATE TYPE topn;
+
+CREATE FUNCTION topn_in(cstring)
+	RETURNS topn
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE STRICT IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_out(topn)
+	RETURNS cstring
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE STRICT IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_recv(internal)
+	RETURNS topn
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE STRICT IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_send(topn)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE STRICT IFPARALLEL(PARALLEL SAFE);
+
+CREATE TYPE topn (
+	INPUT = topn_in,
+	OUTPUT = topn_out,
+	RECEIVE = topn_recv,
+	SEND = topn_send,
+	INTERNALLENGTH = VARIABLE,
+	ALIGNMENT = double,
+	STORAGE = extended
+);
+
+-- conversion from and to the jsonb counters
+CREATE FUNCTION topn_to_jsonb(topn)
+	RETURNS jsonb
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE STRICT IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION jsonb_to_topn(jsonb)
+	RETURNS topn
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE STRICT IFPARALLEL(PARALLEL SAFE);
+
+CREATE CAST (topn AS jsonb) WITH FUNCTION topn_to_jsonb(topn) AS ASSIGNMENT;
+CREATE CAST (jsonb AS topn) WITH FUNCTION jsonb_to_topn(jsonb) AS ASSIGNMENT;
+
+-- basic functions
+CREATE FUNCTION topn(topn, integer)
+	RETURNS SETOF topn_record
+	AS 'MODULE_PATHNAME', 'topn_sketch_topn'
+	LANGUAGE C IMMUTABLE STRICT IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_sketch_add(topn, text)
+	RETURNS topn
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_sketch_add(topn, text[])
+	RETURNS topn
+	AS 'MODULE_PATHNAME', 'topn_sketch_add_array'
+	LANGUAGE C IMMUTABLE IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_sketch_add(topn, text, bigint)
+	RETURNS topn
+	AS 'MODULE_PATHNAME', 'topn_sketch_add_weighted'
+	LANGUAGE C IMMUTABLE IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_sketch_union(topn, topn)
+	RETURNS topn
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE STRICT IFPARALLEL(PARALLEL SAFE);
+
+#if PG_VERSION_NUM >= 180000
+-- let PL/pgSQL change the topn value of a variable in place
+CREATE FUNCTION topn_sketch_support(internal)
+	RETURNS internal
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+ALTER FUNCTION topn_sketch_add(topn, text) SUPPORT topn_sketch_support;
+ALTER FUNCTION topn_sketch_add(topn, text, bigint) SUPPORT topn_sketch_support;
+ALTER FUNCTION topn_sketch_union(topn, topn) SUPPORT topn_sketch_support;
+#endif
+
+-- batch and weighted add for the jsonb counters
+CREATE FUNCTION topn_add(jsonb, text[])
+	RETURNS jsonb
+	AS 'MODULE_PATHNAME', 'topn_add_array'
+	LANGUAGE C IMMUTABLE IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_add(jsonb, text, bigint)
+	RETURNS jsonb
+	AS 'MODULE_PATHNAME', 'topn_add_weighted'
+	LANGUAGE C IMMUTABLE IFPARALLEL(PARALLEL SAFE);
+
+-- trans function
+CREATE FUNCTION topn_sketch_union_trans(internal, topn)
+	RETURNS internal
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_add_weighted_trans(internal, text, bigint)
+	RETURNS internal
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IFPARALLEL(PARALLEL SAFE);
+
+-- Converts internal data structure into a topn sketch.
+CREATE FUNCTION topn_sketch_pack(internal)
+	RETURNS topn
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_add_typed_trans(internal, bigint)
+	RETURNS internal
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_add_typed_trans(internal, uuid)
+	RETURNS internal
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn(topn, integer, anyelement)
+	RETURNS TABLE(item anyelement, frequency bigint)
+	AS 'MODULE_PATHNAME', 'topn_sketch_topn'
+	LANGUAGE C IMMUTABLE IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_remove_trans(internal, text)
+	RETURNS internal
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_remove_weighted_trans(internal, text, bigint)
+	RETURNS internal
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_remove_typed_trans(internal, bigint)
+	RETURNS internal
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_remove_typed_trans(internal, uuid)
+	RETURNS internal
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_add_weighted_trans(internal, text, bigint, integer)
+	RETURNS internal
+	AS 'MODULE_PATHNAME', 'topn_add_weighted_trans'
+	LANGUAGE C IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_remove_weighted_trans(internal, text, bigint, integer)
+	RETURNS internal
+	AS 'MODULE_PATHNAME', 'topn_remove_weighted_trans'
+	LANGUAGE C IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_sketch_empty(integer)
+	RETURNS topn
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE STRICT IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_moving_pack(internal)
+	RETURNS jsonb
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_sketch_moving_pack(internal)
+	RETURNS topn
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_with_error(topn, integer)
+	RETURNS TABLE(item text, lower_bound bigint, upper_bound bigint)
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE STRICT IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_stats(OUT prune_count bigint, OUT evicted_items bigint,
+						   OUT merged_items bigint, OUT jsonb_decodes bigint,
+						   OUT jsonb_decoded_bytes bigint, OUT jsonb_encodes bigint,
+						   OUT jsonb_encoded_bytes bigint, OUT peak_state_size bigint)
+	RETURNS record
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C VOLATILE IFPARALLEL(PARALLEL RESTRICTED);
+
+CREATE FUNCTION topn_stats_reset()
+	RETURNS void
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C VOLATILE IFPARALLEL(PARALLEL RESTRICTED);
+
+CREATE FUNCTION topn_compact(topn, integer)
+	RETURNS topn
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE STRICT IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_compact(jsonb, integer)
+	RETURNS topn
+	AS 'MODULE_PATHNAME', 'jsonb_topn_compact'
+	LANGUAGE C IMMUTABLE STRICT IFPARALLEL(PARALLEL SAFE);
+
+-- point lookups of one item
+CREATE FUNCTION topn_frequency(jsonb, text)
+	RETURNS bigint
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE STRICT IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_frequency(topn, text)
+	RETURNS bigint
+	AS 'MODULE_PATHNAME', 'topn_sketch_frequency'
+	LANGUAGE C IMMUTABLE STRICT IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_frequency(topn, bigint)
+	RETURNS bigint
+	AS 'MODULE_PATHNAME', 'topn_sketch_frequency'
+	LANGUAGE C IMMUTABLE STRICT IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_frequency(topn, uuid)
+	RETURNS bigint
+	AS 'MODULE_PATHNAME', 'topn_sketch_frequency'
+	LANGUAGE C IMMUTABLE STRICT IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_frequency_with_error(topn, text,
+										  OUT lower_bound bigint, OUT upper_bound bigint)
+	RETURNS record
+	AS 'MODULE_PATHNAME', 'topn_frequency_with_error'
+	LANGUAGE C IMMUTABLE STRICT IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_frequency_with_error(topn, bigint,
+										  OUT lower_bound bigint, OUT upper_bound bigint)
+	RETURNS record
+	AS 'MODULE_PATHNAME', 'topn_frequency_with_error'
+	LANGUAGE C IMMUTABLE STRICT IFPARALLEL(PARALLEL SAFE);
+
+CREATE FUNCTION topn_frequency_with_error(topn, uuid,
+										  OUT lower_bound bigint, OUT upper_bound bigint)
+	RETURNS record
+	AS 'MODULE_PATHNAME', 'topn_frequency_with_error'
+	LANGUAGE C IMMUTABLE STRICT IFPARALLEL(PARALLEL SAFE);
+
+-- Aggregates
+-- The state space is the size of a state whose counter table has grown to 128
+-- slots, which hold up to 112 counters. The counter table starts with 32 slots
+-- and doubles as distinct items arrive, so the many small groups of a hash
+-- aggregate stay below this. A state which reaches the default 1000 counters
+-- is about 30 times larger, but declaring that for every group would make the
+-- planner avoid hash aggregates even when the groups only have a few items. A
+-- slot is a 40 byte counter and a control byte: 128 * (40 + 1) = 5248 bytes.
+-- The aggregates which add one item per row also keep a front cache of 32
+-- entries of 16 bytes, which makes 5248 + 512 = 5760 bytes. The keys which are
+-- longer than 16 bytes are kept outside of the counters and are not counted.
+--
+-- topn_add_agg(text) and topn_union_agg(jsonb) are replaced instead of being
+-- dropped and created again, so that the views and functions which use them
+-- are kept through the update.
+DO $do$
+BEGIN
+	IF current_setting('server_version_num')::int >= 120000 THEN
+		EXECUTE $agg$
+			CREATE OR REPLACE AGGREGATE topn_add_agg(text)(
+				SFUNC = topn_add_trans,
+				STYPE = internal,
+				SSPACE = 5760,
+				FINALFUNC = topn_pack,
+				MSFUNC = topn_add_trans,
+				MINVFUNC = topn_remove_trans,
+				MSTYPE = internal,
+				MSSPACE = 5760,
+				MFINALFUNC = topn_moving_pack,
+				COMBINEFUNC = topn_union_internal,
+				SERIALFUNC = topn_serialize,
+				DESERIALFUNC = topn_deserialize,
+				PARALLEL = SAFE
+			)
+		$agg$;
+
+		EXECUTE $agg$
+			CREATE OR REPLACE AGGREGATE topn_union_agg(jsonb)(
+				SFUNC = topn_union_trans,
+				STYPE = internal,
+				SSPACE = 5248,
+				FINALFUNC = topn_pack,
+				COMBINEFUNC = topn_union_internal,
+				SERIALFUNC = topn_serialize,
+				DESERIALFUNC = topn_deserialize,
+				PARALLEL = SAFE
+			)
+		$agg$;
+	ELSE
+		-- CREATE OR REPLACE AGGREGATE only exists from PostgreSQL 12 on, so the
+		-- moving aggregate is written into the catalog of older servers, along
+		-- with the dependencies which CREATE AGGREGATE records for it.
+		UPDATE pg_catalog.pg_aggregate
+		SET aggtransspace = 5760,
+			aggmtransfn = 'topn_add_trans(internal,text)'::regprocedure,
+			aggminvtransfn = 'topn_remove_trans(internal,text)'::regprocedure,
+			aggmfinalfn = 'topn_moving_pack(internal)'::regprocedure,
+			aggmtranstype = 'internal'::regtype,
+			aggmtransspace = 5760
+		WHERE aggfnoid = 'topn_add_agg(text)'::regprocedure;
+
+		INSERT INTO pg_catalog.pg_depend
+		SELECT 'pg_catalog.pg_proc'::regclass, 'topn_add_agg(text)'::regprocedure::oid, 0,
+			   'pg_catalog.pg_proc'::regclass, support_function::oid, 0, 'n'
+		FROM unnest(ARRAY['topn_remove_trans(internal,text)'::regprocedure,
+						  'topn_moving_pack(internal)'::regprocedure]) AS support_function;
+
+		UPDATE pg_catalog.pg_aggregate
+		SET aggtransspace = 5248
+		WHERE aggfnoid = 'topn_union_agg(jsonb)'::regprocedure;
+	END IF;
+END
+$do$;
+
+CREATE AGGREGATE topn_sketch_agg(text)(
+	SFUNC = topn_add_trans,
+	STYPE = internal,
+	SSPACE = 5760,
+	FINALFUNC = topn_sketch_pack,
+	MSFUNC = topn_add_trans,
+	MINVFUNC = topn_remove_trans,
+	MSTYPE = internal,
+	MSSPACE = 5760,
+	MFINALFUNC = topn_sketch_moving_pack
+IFPARALLEL(,
+	COMBINEFUNC = topn_union_internal,
+	SERIALFUNC = topn_serialize,
+	DESERIALFUNC = topn_deserialize,
+	PARALLEL = SAFE)
+);
+
+CREATE AGGREGATE topn_add_agg(text, bigint)(
+	SFUNC = topn_add_weighted_trans,
+	STYPE = internal,
+	SSPACE = 5760,
+	FINALFUNC = topn_pack,
+	MSFUNC = topn_add_weighted_trans,
+	MINVFUNC = topn_remove_weighted_trans,
+	MSTYPE = internal,
+	MSSPACE = 5760,
+	MFINALFUNC = topn_moving_pack
+IFPARALLEL(,
+	COMBINEFUNC = topn_union_internal,
+	SERIALFUNC = topn_serialize,
+	DESERIALFUNC = topn_deserialize,
+	PARALLEL = SAFE)
+);
+
+CREATE AGGREGATE topn_sketch_agg(text, bigint)(
+	SFUNC = topn_add_weighted_trans,
+	STYPE = internal,
+	SSPACE = 5760,
+	FINALFUNC = topn_sketch_pack,
+	MSFUNC = topn_add_weighted_trans,
+	MINVFUNC = topn_remove_weighted_trans,
+	MSTYPE = internal,
+	MSSPACE = 5760,
+	MFINALFUNC = topn_sketch_moving_pack
+IFPARALLEL(,
+	COMBINEFUNC = topn_union_internal,
+	SERIALFUNC = topn_serialize,
+	DESERIALFUNC = topn_deserialize,
+	PARALLEL = SAFE)
+);
+
+CREATE AGGREGATE topn_add_agg(text, bigint, integer)(
+	SFUNC = topn_add_weighted_trans,
+	STYPE = internal,
+	SSPACE = 5760,
+	FINALFUNC = topn_pack,
+	MSFUNC = topn_add_weighted_trans,
+	MINVFUNC = topn_remove_weighted_trans,
+	MSTYPE = internal,
+	MSSPACE = 5760,
+	MFINALFUNC = topn_moving_pack
+IFPARALLEL(,
+	COMBINEFUNC = topn_union_internal,
+	SERIALFUNC = topn_serialize,
+	DESERIALFUNC = topn_deserialize,
+	PARALLEL = SAFE)
+);
+
+CREATE AGGREGATE topn_sketch_agg(text, bigint, integer)(
+	SFUNC = topn_add_weighted_trans,
+	STYPE = internal,
+	SSPACE = 5760,
+	FINALFUNC = topn_sketch_pack,
+	MSFUNC = topn_add_weighted_trans,
+	MINVFUNC = topn_remove_weighted_trans,
+	MSTYPE = internal,
+	MSSPACE = 5760,
+	MFINALFUNC = topn_sketch_moving_pack
+IFPARALLEL(,
+	COMBINEFUNC = topn_union_internal,
+	SERIALFUNC = topn_serialize,
+	DESERIALFUNC = topn_deserialize,
+	PARALLEL = SAFE)
+);
+
+CREATE AGGREGATE topn_add_agg(bigint)(
+	SFUNC = topn_add_typed_trans,
+	STYPE = internal,
+	SSPACE = 5760,
+	FINALFUNC = topn_pack,
+	MSFUNC = topn_add_typed_trans,
+	MINVFUNC = topn_remove_typed_trans,
+	MSTYPE = internal,
+	MSSPACE = 5760,
+	MFINALFUNC = topn_moving_pack
+IFPARALLEL(,
+	COMBINEFUNC = topn_union_internal,
+	SERIALFUNC = topn_serialize,
+	DESERIALFUNC = topn_deserialize,
+	PARALLEL = SAFE)
+);
+
+CREATE AGGREGATE topn_sketch_agg(bigint)(
+	SFUNC = topn_add_typed_trans,
+	STYPE = internal,
+	SSPACE = 5760,
+	FINALFUNC = topn_sketch_pack,
+	MSFUNC = topn_add_typed_trans,
+	MINVFUNC = topn_remove_typed_trans,
+	MSTYPE = internal,
+	MSSPACE = 5760,
+	MFINALFUNC = topn_sketch_moving_pack
+IFPARALLEL(,
+	COMBINEFUNC = topn_union_internal,
+	SERIALFUNC = topn_serialize,
+	DESERIALFUNC = topn_deserialize,
+	PARALLEL = SAFE)
+);
+
+CREATE AGGREGATE topn_add_agg(uuid)(
+	SFUNC = topn_add_typed_trans,
+	STYPE = internal,
+	SSPACE = 5760,
+	FINALFUNC = topn_pack,
+	MSFUNC = topn_add_typed_trans,
+	MINVFUNC = topn_remove_typed_trans,
+	MSTYPE = internal,
+	MSSPACE = 5760,
+	MFINALFUNC = topn_moving_pack
+IFPARALLEL(,
+	COMBINEFUNC = topn_union_internal,
+	SERIALFUNC = topn_serialize,
+	DESERIALFUNC = topn_deserialize,
+	PARALLEL = SAFE)
+);
+
+CREATE AGGREGATE topn_sketch_agg(uuid)(
+	SFUNC = topn_add_typed_trans,
+	STYPE = internal,
+	SSPACE = 5760,
+	FINALFUNC = topn_sketch_pack,
+	MSFUNC = topn_add_typed_trans,
+	MINVFUNC = topn_remove_typed_trans,
+	MSTYPE = internal,
+	MSSPACE = 5760,
+	MFINALFUNC = topn_sketch_moving_pack
+IFPARALLEL(,
+	COMBINEFUNC = topn_union_internal,
+	SERIALFUNC = topn_serialize,
+	DESERIALFUNC = topn_deserialize,
+	PARALLEL = SAFE)
+);
+
+CREATE AGGREGATE topn_union_agg(topn)(
+	SFUNC = topn_sketch_union_trans,
+	STYPE = internal,
+	SSPACE = 5248,
+	FINALFUNC = topn_sketch_pack
+IFPARALLEL(,
+	COMBINEFUNC = topn_union_internal,
+	SERIALFUNC = topn_serialize,
+	DESERIALFUNC = topn_deserialize,
+	PARALLEL = SAFE)
+);
+
+CREATE OPERATOR + (
+	leftarg = topn,
+	rightarg = topn,
+	procedure = topn_sketch_union,
+	commutator = +
+);
+
+COMMENT ON TYPE topn
+	IS 'binary top-n counter';
+COMMENT ON FUNCTION topn(top_items topn, n integer)
+	IS 'get the top n items from top_items';
+COMMENT ON FUNCTION topn(top_items topn, n integer, item_type anyelement)
+	IS 'get the top n items from top_items as values of the type of item_type';
+COMMENT ON FUNCTION topn_sketch_add(top_items topn, item text)
+	IS 'insert the item into the top_items counter';
+COMMENT ON FUNCTION topn_sketch_add(top_items topn, items text[])
+	IS 'insert the items into the top_items counter';
+COMMENT ON FUNCTION topn_sketch_add(top_items topn, item text, weight bigint)
+	IS 'insert the item into the top_items counter with the given weight';
+COMMENT ON FUNCTION topn_add(top_items jsonb, items text[])
+	IS 'insert the items into the top_items counter';
+COMMENT ON FUNCTION topn_add(top_items jsonb, item text, weight bigint)
+	IS 'insert the item into the top_items counter with the given weight';
+COMMENT ON FUNCTION topn_sketch_union(top_items topn, top_items2 topn)
+	IS 'take the union of the two top_items counter';
+COMMENT ON AGGREGATE topn_sketch_agg(item text)
+	IS 'aggregate the items into one topn counter';
+COMMENT ON AGGREGATE topn_add_agg(item text, weight bigint)
+	IS 'aggregate the weighted items into one counter';
+COMMENT ON AGGREGATE topn_sketch_agg(item text, weight bigint)
+	IS 'aggregate the weighted items into one topn counter';
+COMMENT ON FUNCTION topn_sketch_empty(capacity integer)
+	IS 'create an empty topn counter which keeps the given number of counters';
+COMMENT ON AGGREGATE topn_add_agg(item text, weight bigint, capacity integer)
+	IS 'aggregate the weighted items into one counter with the given capacity';
+COMMENT ON AGGREGATE topn_sketch_agg(item text, weight bigint, capacity integer)
+	IS 'aggregate the weighted items into one topn counter with the given capacity';
+COMMENT ON AGGREGATE topn_add_agg(item bigint)
+	IS 'aggregate the bigint items into one counter';
+COMMENT ON AGGREGATE topn_add_agg(item uuid)
+	IS 'aggregate the uuid items into one counter';
+COMMENT ON AGGREGATE topn_sketch_agg(item bigint)
+	IS 'aggregate the bigint items into one topn counter';
+COMMENT ON AGGREGATE topn_sketch_agg(item uuid)
+	IS 'aggregate the uuid items into one topn counter';
+COMMENT ON AGGREGATE topn_union_agg(item_counter topn)
+	IS 'aggregate the topn counters into one counter';
+COMMENT ON FUNCTION topn_with_error(top_items topn, n integer)
+	IS 'get the top n items from top_items with the bounds of their frequencies';
+COMMENT ON FUNCTION topn_stats()
+	IS 'get the counters of the topn functions in this backend';
+COMMENT ON FUNCTION topn_stats_reset()
+	IS 'reset the counters of the topn functions in this backend';
+COMMENT ON FUNCTION topn_compact(top_items topn, capacity integer)
+	IS 'trim top_items to the given capacity and store it in the compact encoding';
+COMMENT ON FUNCTION topn_compact(top_items jsonb, capacity integer)
+	IS 'trim top_items to the given capacity and store it as a compact topn counter';
+COMMENT ON FUNCTION topn_frequency(top_items jsonb, item text)
+	IS 'get the frequency of the item in top_items';
+COMMENT ON FUNCTION topn_frequency(top_items topn, item text)
+	IS 'get the frequency of the item in top_items';
+COMMENT ON FUNCTION topn_frequency(top_items topn, item bigint)
+	IS 'get the frequency of the item in top_items';
+COMMENT ON FUNCTION topn_frequency(top_items topn, item uuid)
+	IS 'get the frequency of the item in top_items';
+COMMENT ON FUNCTION topn_frequency_with_error(top_items topn, item text)
+	IS 'get the bounds of the frequency of the item in top_items';
+COMMENT ON FUNCTION topn_frequency_with_error(top_items topn, item bigint)
+	IS 'get the bounds of the frequency of the item in top_items';
+COMMENT ON FUNCTION topn_frequency_with_error(top_items topn, item uuid)
+	IS 'get the bounds of the frequency of the item in top_items';
+#if PG_VERSION_NUM >= 180000
+COMMENT ON FUNCTION topn_sketch_support(internal)
+	IS 'planner support function of the functions which add to a topn counter';
+#endif